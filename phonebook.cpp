@@ -1,41 +1,370 @@
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
 
 constexpr auto SAVE_FILE_NAME = "phonebook.txt";
+// Binary copy of the book that can be mapped straight into memory.
+constexpr auto SNAPSHOT_FILE_NAME = "phonebook.snap";
+// Write a snapshot next to the text file on every save, and load from it when
+// it's at least as new as the text file.
+constexpr auto USE_SNAPSHOT = true;
+// Append every change to a journal as it happens, so nothing is lost between
+// saves. Saving folds the journal into the save files and empties it.
+constexpr auto JOURNAL_FILE_NAME = "phonebook.journal";
+constexpr auto USE_JOURNAL = true;
+// Journal records written to disk (and fsync'd) together.
+constexpr size_t JOURNAL_GROUP_COMMIT = 64;
+// Save automatically once the journal holds this many records.
+constexpr size_t JOURNAL_COMPACT_AFTER = 100000;
 // Search for and load in a save file if found.
 constexpr auto LOAD_ON_STARTUP = true;
+// Show the menu as soon as lookups can be answered from the save files, and
+// build the tree on a background thread (see Book::load_lazily).
+constexpr auto LAZY_LOAD = true;
+// Keep the tree height balanced (AVL) so sorted input doesn't degrade the tree
+// into a linked list.
+constexpr auto BALANCED_TREE = true;
+// Keep the book's entries in a B+-tree instead of the AVL tree. Lookups then
+// search a few wide nodes instead of many scattered ones, and in-order scans
+// read the leaves front to back.
+constexpr auto BPLUS_TREE_BOOK = false;
+// Keys each node of the B+-tree holds. Even, so their prefixes can be
+// compared two at a time.
+constexpr int BPLUS_TREE_FANOUT = 32;
+// Read the whole save file, sort it once and build a balanced tree in one
+// pass instead of inserting entries one at a time.
+constexpr auto BULK_LOAD = true;
+// Bulk load save files at least this big on every core. Smaller ones aren't
+// worth starting threads for.
+constexpr size_t PARALLEL_LOAD_MIN_BYTES = 16 << 20;
+// Guard every public Book operation with a reader-writer lock so lookups can
+// run from many threads at once.
+constexpr auto THREAD_SAFE_BOOK = false;
+// Save and export thread-safe books from a frozen version of them, so other
+// threads can go on changing the book while the files are written. This keeps
+// a second, persistent copy of the tree up to date once the first save has
+// built it, so books that aren't thread-safe save under their lock instead.
+constexpr auto SAVE_FROM_VERSION = true;
+// Independent stripes the reader-writer lock is split into.
+constexpr size_t LOCK_STRIPES = 16;
+// Books a sharded book splits its entries across, each run by a thread of its
+// own.
+constexpr size_t SHARD_COUNT = 4;
+// Shard i keeps its files under SHARD_FILE_STEM followed by i, and the manifest
+// records how the book was split when it was saved.
+constexpr auto SHARD_FILE_STEM = "phonebook.shard";
+constexpr auto SHARD_MANIFEST_NAME = "phonebook.shards";
+// Entries a shard hands a merged scan at a time.
+constexpr size_t SHARD_SCAN_BATCH = 256;
+// Count, time and histogram every Book operation. With this off the
+// recording compiles away entirely.
+constexpr auto COLLECT_METRICS = true;
+// Number of nodes carved out of each block the node pool allocates.
+constexpr size_t NODE_POOL_BLOCK_SIZE = 4096;
+// Size of each block of name text the string arena allocates.
+constexpr size_t STRING_ARENA_BLOCK_SIZE = 64 * 1024;
+// Bytes read from the save file at a time while parsing it.
+constexpr size_t CSV_BLOCK_SIZE = 1 << 20;
+// Malformed lines reported individually before the parser just counts them.
+constexpr size_t MAX_REPORTED_PARSE_ERRORS = 10;
+// Fuzzy search only suggests names within this many typos of the query.
+constexpr int FUZZY_MAX_DISTANCE = 3;
+// Entries sharing the most trigrams with a fuzzy query that get their edit
+// distance checked. The rest are assumed to be too far off.
+constexpr size_t FUZZY_CANDIDATES = 2000;
+// Suggestions shown for a fuzzy search from the menu.
+constexpr size_t FUZZY_RESULTS = 10;
+// Bytes of commands read at a time in batch mode. Everything read in one go
+// is applied and journaled before any of it is answered.
+constexpr size_t BATCH_READ_SIZE = 1 << 16;
+// Unix domain socket the server listens on.
+constexpr auto SERVER_SOCKET_NAME = "phonebook.sock";
+// The server stops reading a client's commands while this many bytes of
+// answers are waiting for it to read them.
+constexpr size_t SERVER_MAX_BACKLOG = 1 << 20;
+// Events taken from epoll per pass of the server's event loop.
+constexpr int SERVER_MAX_EVENTS = 256;
+// Calls whose individual latency --bench keeps per operation. Longer runs
+// sample every n-th call.
+constexpr size_t BENCH_LATENCY_SAMPLES = 1 << 20;
+// Entries shown at a time when paging through the book from the menu.
+constexpr size_t DISPLAY_PAGE_SIZE = 20;
+// Bytes of rows gathered before they're written out when the whole book is
+// displayed or exported.
+constexpr size_t DISPLAY_BUFFER_SIZE = 1 << 20;
+// File the whole book is written to, as a table, by the export option.
+constexpr auto EXPORT_FILE_NAME = "phonebook_export.txt";
+// File the compressed export and import options write and read.
+constexpr auto COMPRESSED_FILE_NAME = "phonebook.pbz";
+// Entries per block of a compressed file. A lookup in the file decodes one
+// block, so smaller blocks are quicker to search and larger ones compress a
+// little better.
+constexpr size_t COMPRESSED_BLOCK_ENTRIES = 64;
 // For spacing purposes.
 constexpr auto COLUMN_TAB_WIDTH = "\t\t\t";
 constexpr auto DIVIDER =
     "------------------------------------------------------------------------";
 
+struct Field {
+    // A piece of text that lives somewhere else, usually in the parser's
+    // buffer.
+    char *data;
+    size_t length;
+
+    std::string str() const { return std::string(data, length); }
+};
+
 // Define Person class.
 class Person {
+    // A compact view of one entry. The uppercase names are stored elsewhere
+    // (normally in the owning Book's String_Arena) as "LAST\0FIRST\0",
+    // followed by "PHONE\0" when the phone number can't be packed into
+    // phone_digits. The '\0' separator sorts below every other character, so
+    // comparing keys byte by byte orders by last name and then first name,
+    // which lets the first eight bytes double as an integer sort key.
   public:
-    std::string first;
-    std::string last;
-    std::string phone_number;
-    Person(std::string first, std::string last, std::string phone_number)
-        : first(first), last(last), phone_number(phone_number) {}
+    // First eight bytes of the key, big endian and zero padded. Two people
+    // with different prefixes compare the same way their prefixes do.
+    uint64_t key_prefix;
+    const char *key;
+    // Phone number packed one digit per nibble (stored as digit + 1, so a
+    // zero nibble ends the number). Zero means the number is stored as text
+    // after the names instead.
+    uint64_t phone_digits;
+    uint16_t last_length;
+    uint16_t first_length;
+
+    Person()
+        : key_prefix(0), key("\0\0"), phone_digits(0), last_length(0),
+          first_length(0) {}
+
+    Person(const char *key, size_t last_length, size_t first_length,
+           uint64_t phone_digits)
+        : key_prefix(make_prefix(key, last_length + 1 + first_length)),
+          key(key), phone_digits(phone_digits), last_length(last_length),
+          first_length(first_length) {}
+
+    Person(uint64_t key_prefix, const char *key, size_t last_length,
+           size_t first_length, uint64_t phone_digits)
+        : key_prefix(key_prefix), key(key), phone_digits(phone_digits),
+          last_length(last_length), first_length(first_length) {}
+
+    static Person pack(const std::string &first, const std::string &last,
+                       const std::string &phone_number, std::string &buffer) {
+        return pack(first.data(), first.length(), last.data(), last.length(),
+                    phone_number.data(), phone_number.length(), buffer);
+    }
+
+    static Person pack(const char *first, size_t first_length,
+                       const char *last, size_t last_length,
+                       const char *phone_number, size_t phone_length,
+                       std::string &buffer) {
+        // Lay the record out in buffer and return a Person viewing it. The
+        // buffer has to outlive the Person (or be copied into an arena).
+        uint64_t digits = pack_phone(phone_number, phone_length);
+        buffer.assign(last, last_length);
+        buffer.push_back('\0');
+        buffer.append(first, first_length);
+        buffer.push_back('\0');
+        if (!digits) {
+            buffer.append(phone_number, phone_length);
+            buffer.push_back('\0');
+        }
+        return Person(buffer.data(), last_length, first_length, digits);
+    }
+
+    static uint64_t pack_phone(const std::string &phone_number) {
+        return pack_phone(phone_number.data(), phone_number.length());
+    }
+
+    static uint64_t pack_phone(const char *phone_number, size_t length) {
+        // Pack up to 16 decimal digits. Anything else (or nothing at all) has
+        // to be stored as text, signalled by returning zero.
+        if (length == 0 || length > 16) {
+            return 0;
+        }
+        uint64_t digits = 0;
+        for (size_t i = 0; i < length; i++) {
+            if (phone_number[i] < '0' || phone_number[i] > '9') {
+                return 0;
+            }
+            digits |= uint64_t(phone_number[i] - '0' + 1) << (60 - 4 * i);
+        }
+        return digits;
+    }
+
+    static uint64_t make_prefix(const char *key, size_t length) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; i++) {
+            prefix <<= 8;
+            if (i < length) {
+                prefix |= static_cast<unsigned char>(key[i]);
+            }
+        }
+        return prefix;
+    }
 
-    Person(std::string first, std::string last) : first(first), last(last) {}
+    size_t key_length() const { return last_length + 1 + first_length; }
+    // Length of all the text the record owns, terminators included.
+    size_t text_length() const {
+        size_t length = key_length() + 1;
+        if (!phone_digits) {
+            length += std::strlen(key + length) + 1;
+        }
+        return length;
+    }
+    const char *last_data() const { return key; }
+    const char *first_data() const { return key + last_length + 1; }
+    std::string last() const { return std::string(key, last_length); }
+    std::string first() const {
+        return std::string(first_data(), first_length);
+    }
+
+    std::string phone_number() const {
+        if (!phone_digits) {
+            return std::string(first_data() + first_length + 1);
+        }
+        std::string phone;
+        for (int shift = 60; shift >= 0; shift -= 4) {
+            unsigned nibble = (phone_digits >> shift) & 0xF;
+            if (!nibble) {
+                break;
+            }
+            phone.push_back(char('0' + nibble - 1));
+        }
+        return phone;
+    }
 
-    void display_person() {
+    void display_person() const {
         // Helper function to print data.
-        std::cout << this->first << COLUMN_TAB_WIDTH << this->last
-                  << COLUMN_TAB_WIDTH << this->phone_number << std::endl;
+        std::string row;
+        display_person(row);
+        std::cout << row;
+    }
+
+    void display_person(std::string &out) const {
+        // Append the printed row to out, so many rows can be written at once.
+        out.append(first_data(), first_length);
+        out += COLUMN_TAB_WIDTH;
+        out.append(last_data(), last_length);
+        out += COLUMN_TAB_WIDTH;
+        out += phone_number();
+        out += '\n';
+    }
+
+    static int compare(const Person &p1, const Person &p2) {
+        // Perform alphabetical comparisons on last and first names. Most
+        // pairs differ somewhere in their first eight bytes, so the integer
+        // prefix settles the comparison without touching the text.
+        if (p1.key_prefix != p2.key_prefix) {
+            return p1.key_prefix > p2.key_prefix ? 1 : -1;
+        }
+        int result = compare_text(p1.last_data(), p1.last_length,
+                                  p2.last_data(), p2.last_length);
+        if (result == 0) {
+            result = compare_text(p1.first_data(), p1.first_length,
+                                  p2.first_data(), p2.first_length);
+        }
+        return result;
+    }
+
+    static int compare_text(const char *a, size_t a_length, const char *b,
+                            size_t b_length) {
+        // Byte-wise comparison returning -1, 0 or 1.
+        int result = std::memcmp(a, b, std::min(a_length, b_length));
+        if (result == 0) {
+            return a_length == b_length ? 0 : (a_length > b_length ? 1 : -1);
+        }
+        return result > 0 ? 1 : -1;
+    }
+
+    int compare_key(const char *other, size_t length) const {
+        // Compare against raw key bytes laid out as "LAST\0FIRST". Ordering
+        // the raw bytes gives the same order as compare(), since the NUL
+        // separator sorts below every character in a name.
+        return compare_text(key, key_length(), other, length);
+    }
+
+    bool has_prefix(const char *prefix, size_t length) const {
+        return length <= key_length() && std::memcmp(key, prefix, length) == 0;
     }
 
     // Encode person data for save file.
-    std::string encode() { return first + "," + last + "," + phone_number; }
-    static Person decode(std::string s) {
-        // Create Person object from a line in the save file.
-        std::string first, last, phone_number;
+    std::string encode() const {
+        return encode_field(first()) + "," + encode_field(last()) + "," +
+               encode_field(phone_number());
+    }
+
+    static std::string encode_field(const std::string &field) {
+        // Quote fields CSV_Parser would otherwise split or trim.
+        bool quote = !field.empty() &&
+                     (field.find_first_of(",\"\n\r") != std::string::npos ||
+                      field.front() == ' ' || field.front() == '\t' ||
+                      field.back() == ' ' || field.back() == '\t');
+        if (!quote) {
+            return field;
+        }
+        std::string quoted = "\"";
+        for (size_t i = 0; i < field.length(); i++) {
+            if (field[i] == '"') {
+                quoted.push_back('"');
+            }
+            quoted.push_back(field[i]);
+        }
+        quoted.push_back('"');
+        return quoted;
+    }
+
+    static void decode(std::string s, std::string &first, std::string &last,
+                       std::string &phone_number) {
+        // Split a line from the save file into its fields. This is the
+        // original decoder; loading goes through CSV_Parser now, and this is
+        // kept as the baseline for --bench-parse.
+        first.clear();
+        last.clear();
+        phone_number.clear();
         int comma_count = 0;
         for (size_t i = 0; i < s.length(); i++) {
             if (s[i] == ',') {
@@ -62,215 +391,3540 @@ class Person {
                 break;
             }
         }
-
-        return Person(first, last, phone_number);
     }
 };
 
-class BST_Node {
+class CSV_Parser {
+    // Streams records (first,last,phone by default) out of a save file. The
+    // file is read a large block at a time and records are handed out as
+    // Fields pointing into the block, so nothing is copied until the caller
+    // decides to keep a record. Fields may be wrapped in double quotes (with
+    // "" for a literal quote), which lets them hold commas, newlines and edge
+    // whitespace. Unquoted fields have surrounding whitespace trimmed. Lines
+    // with the wrong number of fields are skipped and reported by line number.
   public:
-    Person person;
-    BST_Node *left;
-    BST_Node *right;
+    CSV_Parser(std::istream &input) : CSV_Parser(input, 3) {}
+    CSV_Parser(std::istream &input, size_t field_count)
+        : CSV_Parser(input, field_count, 1) {}
+    // first_line numbers the lines in error messages when the input starts
+    // partway through a file.
+    CSV_Parser(std::istream &input, size_t field_count, size_t first_line)
+        : input(input), field_count(field_count), buffer(CSV_BLOCK_SIZE),
+          begin(0), end(0), line(first_line), malformed(0), eof(false) {}
 
-    BST_Node(std::string first, std::string last, std::string phone_number)
-        : person(first, last, phone_number), left(nullptr), right(nullptr) {}
-};
+    bool next(Field *fields) {
+        // Fill fields with the next good record. Returns false at the end of
+        // the input. The fields stay valid until the next call.
+        while (true) {
+            char *record = buffer.data() + begin;
+            char *limit = buffer.data() + end;
+            size_t newlines = 0;
+            char *record_end = find_record_end(record, limit, newlines);
+            if (record_end == limit && !eof) {
+                // The record runs past what we've read so far.
+                refill();
+                continue;
+            }
+            if (record == limit) {
+                return false;
+            }
 
-class Book {
-  public:
-    Book() : head(nullptr), count(0) {}
+            size_t record_line = line;
+            line += newlines + 1;
+            begin = record_end - buffer.data() + (record_end < limit);
 
-    bool add_entry(std::string first, std::string last,
-                   std::string phone_number) {
-        // Create a new node on the heap.
-        first_last_to_upper(first, last);
-        BST_Node *new_node = new BST_Node(first, last, phone_number);
+            const char *error =
+                parse_record(record, record_end, fields, field_count);
+            if (!error) {
+                return true;
+            }
+            if (*error) {
+                report(record_line, error);
+            }
+        }
+    }
 
-        // Check if the tree is empty.
-        if (is_empty()) {
-            // If empty, make the new node the new head.
-            this->head = new_node;
-            count++;
-            return true;
+    size_t malformed_lines() const { return malformed; }
+    const std::vector<std::string> &errors() const { return messages; }
+
+    static char *find_any(char *p, char *limit, char a, char b) {
+        // Return the first a or b in [p, limit), or limit. Sixteen bytes are
+        // checked per step where SSE2 is available.
+#if defined(__SSE2__)
+        const __m128i match_a = _mm_set1_epi8(a);
+        const __m128i match_b = _mm_set1_epi8(b);
+        while (limit - p >= 16) {
+            __m128i chunk =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            int mask = _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, match_a),
+                             _mm_cmpeq_epi8(chunk, match_b)));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+            p += 16;
+        }
+#endif
+        while (p < limit && *p != a && *p != b) {
+            p++;
         }
+        return p;
+    }
 
-        // Return a boolean value depending on success.
-        return !!this->insertion(head, new_node);
+    static char *find_record_end(char *p, char *limit, size_t &newlines) {
+        // Find the newline ending the record at p, skipping newlines inside
+        // quotes. Returns limit if there isn't one yet.
+        bool quoted = false;
+        while (true) {
+            p = find_any(p, limit, '"', '\n');
+            if (p == limit || (*p == '\n' && !quoted)) {
+                return p;
+            }
+            if (*p == '"') {
+                quoted = !quoted;
+            } else {
+                newlines++;
+            }
+            p++;
+        }
     }
 
-    void display_book() {
-        // Perform an inorder traversal on the tree.
-        if (is_empty()) {
-            std::cout << "\nNo records\n" << std::endl;
-            return;
+    static const char *parse_record(char *p, char *limit, Field *fields,
+                                    size_t field_count) {
+        // Split one complete record into field_count fields. Returns nullptr
+        // on success, an empty string for a blank line and otherwise what was
+        // wrong. Quoted fields are unescaped in place.
+        if (limit > p && limit[-1] == '\r') {
+            limit--;
+        }
+        char *q = skip_blanks(p, limit);
+        if (q == limit) {
+            return "";
         }
 
-        std::cout << "Phonebook contains " << count << " entries.\n"
-                  << std::endl;
-        std::cout << "#\t" << "First" << COLUMN_TAB_WIDTH << "Last"
-                  << COLUMN_TAB_WIDTH << "Phone Number" << std::endl;
-        std::cout << DIVIDER << std::endl;
-        // Call recursive function to perform in order traversal.
-        size_t counter = 1;
-        inorder_display(head, counter);
-        std::cout << DIVIDER << "\n" << std::endl;
-    }
+        size_t found = 0;
+        while (true) {
+            Field field;
+            q = skip_blanks(q, limit);
+            if (q < limit && *q == '"') {
+                // Quoted field. Escaped quotes are collapsed in place, which
+                // only ever shrinks the field.
+                char *read = q + 1, *write = q + 1;
+                field.data = write;
+                while (true) {
+                    char *quote = find_any(read, limit, '"', '"');
+                    if (quote == limit) {
+                        return "unterminated quoted field";
+                    }
+                    std::memmove(write, read, quote - read);
+                    write += quote - read;
+                    if (quote + 1 < limit && quote[1] == '"') {
+                        *write++ = '"';
+                        read = quote + 2;
+                        continue;
+                    }
+                    read = quote + 1;
+                    break;
+                }
+                field.length = write - field.data;
+                q = skip_blanks(read, limit);
+                if (q < limit && *q != ',') {
+                    return "unexpected text after closing quote";
+                }
+            } else {
+                char *delimiter = find_any(q, limit, ',', '"');
+                if (delimiter < limit && *delimiter == '"') {
+                    return "quote inside unquoted field";
+                }
+                field.data = q;
+                // Trim trailing whitespace.
+                char *field_end = delimiter;
+                while (field_end > q &&
+                       (field_end[-1] == ' ' || field_end[-1] == '\t')) {
+                    field_end--;
+                }
+                field.length = field_end - q;
+                q = delimiter;
+            }
 
-    BST_Node *find_entry(std::string first, std::string last) {
-        // Convert first and last name to uppercase.
-        first_last_to_upper(first, last);
-        // Run locate node recursive search.
-        Person p{first, last};
-        return locate_node(head, &p, false);
-    }
+            if (found < field_count) {
+                fields[found] = field;
+            }
+            found++;
+            if (q == limit) {
+                break;
+            }
+            q++; // Step over the comma.
+        }
 
-    Person *change_entry(std::string first, std::string last,
-                         std::string phone_number) {
-        // Convert first and last to uppercase.
-        first_last_to_upper(first, last);
+        if (found != field_count) {
+            return found < field_count ? "too few fields" : "too many fields";
+        }
+        return nullptr;
+    }
 
-        // Locate the node.
-        BST_Node *entry = find_entry(first, last);
+  private:
+    std::istream &input;
+    // Number of fields every record must have.
+    size_t field_count;
+    std::vector<char> buffer;
+    // Unparsed bytes are buffer[begin, end).
+    size_t begin, end;
+    // Line number of the next record.
+    size_t line;
+    size_t malformed;
+    bool eof;
+    std::vector<std::string> messages;
 
-        if (!entry) {
-            std::cout << "\nCould not locate entry\n" << std::endl;
-            return nullptr;
+    void refill() {
+        // Slide the unparsed tail to the front and read the next block after
+        // it, growing the buffer if a single record fills all of it.
+        size_t remaining = end - begin;
+        std::memmove(buffer.data(), buffer.data() + begin, remaining);
+        begin = 0;
+        end = remaining;
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        input.read(buffer.data() + end, buffer.size() - end);
+        end += input.gcount();
+        if (!input) {
+            eof = true;
         }
+    }
 
-        if (phone_number.length() <= 0) {
-            std::cout << "\nPhone number cannot be blank\n" << std::endl;
-            return nullptr;
+    static char *skip_blanks(char *p, char *limit) {
+        while (p < limit && (*p == ' ' || *p == '\t')) {
+            p++;
         }
+        return p;
+    }
 
-        entry->person.phone_number = phone_number;
-        return &entry->person;
+    void report(size_t line_number, const char *error) {
+        malformed++;
+        if (messages.size() < MAX_REPORTED_PARSE_ERRORS) {
+            messages.push_back("Line " + std::to_string(line_number) + ": " +
+                               error);
+        }
     }
+};
 
-    bool delete_entry(std::string first, std::string last) {
-        /***
-         * I did deletion a little weird here. I wanted a certain node's memory
-         * address to always point to the same value throughout that node's
-         * entire lifetime. When deleting an node with both a left and right
-         * child, normally we perform a value swapping operation with the node
-         * and its in order successor. However, this could lead to unexpected
-         * behavior. Say you have a pointer to Node B. Node B happens to be the
-         * in order successor to Node A. Their values get swapped and then Node
-         * B gets deleted. From your pointer variable's perspective this was
-         * unexpected behavior and now your pointer is broken. In order to fix
-         * this, I do deletion without any swapping. This means that the
-         * pointers are maintained throughout a node's life.
-         */
+class Memory_Buffer : public std::streambuf {
+    // Lets a stream, and so a CSV_Parser, read straight out of memory.
+  public:
+    Memory_Buffer(char *begin, char *end) { setg(begin, begin, end); }
+};
 
-        // Convert to uppercase.
-        first_last_to_upper(first, last);
-        Person p{first, last};
+class String_Arena {
+    // Bump allocator holding the text of every Person in a Book. Strings are
+    // never freed one at a time (text orphaned by a delete or a phone change
+    // just sits there); the whole arena is dropped when the book is cleared.
+  public:
+    String_Arena() : used(0), capacity(0), allocated(0) {}
+    ~String_Arena() { release_all(); }
 
-        int direction =
-            0; // -1 Means the node to delete is on the left, 0 means it's equal
-               // to the parent, and 1 means it's on the right.
+    String_Arena(const String_Arena &) = delete;
+    String_Arena &operator=(const String_Arena &) = delete;
 
-        // Locate the parent of the node we wish to delete
-        BST_Node *parent = locate_node(head, &p, true);
+    const char *store(const std::string &text) {
+        return store(text.data(), text.length());
+    }
 
-        // locate_node should never return nullptr in this case. So, end here
-        // if the value to delete doesn't exist. locate_node will return
-        // the value itself if it has no parent (ie. it's the root node).
-        if (!parent)
-            return false;
+    const char *store(const char *text, size_t length) {
+        // Copy text into the arena and return where it landed.
+        reserve(length);
+        char *destination = blocks.back() + used;
+        std::memcpy(destination, text, length);
+        used += length;
+        return destination;
+    }
 
-        // A pointer to keep track of the actual node to delete.
-        BST_Node *entry;
+    void reserve(size_t length) {
+        // Make sure storing up to length bytes next won't need to allocate.
+        if (capacity - used < length) {
+            capacity = std::max(STRING_ARENA_BLOCK_SIZE, length);
+            blocks.push_back(new char[capacity]);
+            allocated += capacity;
+            used = 0;
+        }
+    }
 
-        // We set the node depending on whether or not it's the left or right
-        // child of the parent.
-        if (parent->left && compare_names(parent->left->person, p) == 0) {
-            direction = -1;
-            entry = parent->left;
-        } else if (parent->right &&
-                   compare_names(parent->right->person, p) == 0) {
-            direction = 1;
-            entry = parent->right;
-        } else {
-            // This means that we're dealing with the root node as the parent is
-            // equal to the node to delete.
-            entry = parent;
+    void unstore(size_t length) {
+        // Hand back the last length bytes stored, which have to be what the
+        // most recent store() call copied in.
+        used -= length;
+    }
+
+    void release_all() {
+        for (size_t i = 0; i < blocks.size(); i++) {
+            delete[] blocks[i];
         }
+        blocks.clear();
+        used = 0;
+        capacity = 0;
+        allocated = 0;
+    }
 
-        // This set of if statements determines how many children the node has.
-        if (entry->left && entry->right) {
-            // The node has both its children.
-            // We need to find the minimum element of the right subtree.
-            BST_Node *next_element = entry->right;
-            BST_Node *next_element_parent =
-                entry; // Keep track of the next element's parent as well.
+    // Bytes held in all the blocks.
+    size_t bytes() const { return allocated; }
 
-            // Recurse down the left side of the node's right subtree.
-            while (next_element && next_element->left) {
-                next_element_parent = next_element;
-                next_element = next_element->left;
-            }
+    void adopt(String_Arena &other) {
+        // Take over every block of other, leaving it empty. They go in front
+        // of ours so our newest block stays the one being filled.
+        blocks.insert(blocks.begin(), other.blocks.begin(), other.blocks.end());
+        allocated += other.allocated;
+        other.blocks.clear();
+        other.release_all();
+    }
 
-            // If the node is the right subchild of its parent
-            if (direction == 1) {
-                // Move the parent's right pointer to the node's next greatest
-                // element.
-                parent->right = next_element;
-            } else if (direction == -1) {
-                // Do the opposite of the above.
-                parent->left = next_element;
-            } else {
-                // If direction == 0, then we need to set head to be the next
-                // element.
-                head = next_element;
-            }
+  private:
+    std::vector<char *> blocks;
+    // Bytes handed out from, and total size of, the newest block.
+    size_t used;
+    size_t capacity;
+    size_t allocated;
+};
 
-            if (next_element != entry->right) {
-                // If the next element isn't the node's direct child, then we
-                // need to reposition its parent to point to the next value
-                // beyond the in order successor.
-                next_element_parent->left = next_element->right;
-                // We also need to move the right pointer of the right child of
-                // the deleted node.
-                next_element->right = entry->right;
-            }
+bool sync_path(const char *path) {
+    // Flush a file or directory to disk by name.
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
 
-            // The replacement node's left child should match the deleted node's
-            // left child.
-            next_element->left = entry->left;
-            // Deallocate the deleted node.
-            delete entry;
-            // Decrement the counter.
-            count--;
-            return true;
-        } else if (entry->left) {
-            // Node only has left child. Depending on the direction, jump over
-            // the node to be deleted.
-            if (direction == -1) {
-                parent->left = entry->left;
-            } else if (direction == 1) {
-                parent->right = entry->left;
-            } else {
-                head = entry->left;
-            }
+bool replace_file(const std::string &temporary, const char *path) {
+    // Atomically move a fully written temporary file over path. The data is
+    // flushed before the rename and the directory after it, so after a crash
+    // path holds either the old contents or the new ones, never a mix.
+    if (!sync_path(temporary.c_str()) ||
+        std::rename(temporary.c_str(), path) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    std::string directory = path;
+    size_t slash = directory.rfind('/');
+    directory =
+        slash == std::string::npos ? "." : directory.substr(0, slash + 1);
+    sync_path(directory.c_str());
+    return true;
+}
 
-            // Deallocate the deleted node.
-            delete entry;
-            count--;
-        } else if (entry->right) {
-            // Same process as above, just the opposite side.
-            if (direction == -1) {
-                parent->left = entry->right;
-            } else if (direction == 1) {
-                parent->right = entry->right;
-            } else {
-                head = entry->right;
+bool write_all(int fd, const char *data, size_t length) {
+    // write() until everything is out, since it may stop short.
+    while (length > 0) {
+        ssize_t result = ::write(fd, data, length);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            delete entry;
-            count--;
-        } else {
-            // Node is a leaf node. Set it to nullptr and update its parent.
-            delete entry;
+            return false;
+        }
+        data += result;
+        length -= result;
+    }
+    return true;
+}
+
+class Journal {
+    // Append-only log of the changes made since the book was last saved, one
+    // CSV line per change: op,first,last,phone,checksum. Records are buffered
+    // and written with a single fsync per group (or whenever sync() is
+    // called), so a change costs a small append instead of a full save. The
+    // checksum lets replay recognise a record torn by a crash.
+  public:
+    Journal() : fd(-1), pending(0), records(0), written(0) {}
+    ~Journal() { close(); }
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    bool open(const char *path) {
+        close();
+        this->path = path;
+        fd = ::open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+        struct stat info;
+        written = fd >= 0 && fstat(fd, &info) == 0 ? info.st_size : 0;
+        return fd >= 0;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            sync();
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+    bool is_open() const { return fd >= 0; }
+    // Records logged since the journal was last emptied.
+    size_t size() const { return records; }
+    // Nothing logged, on disk or still buffered.
+    bool is_empty() const { return written == 0 && buffer.empty(); }
+    void set_size(size_t size) { records = size; }
+
+    void append(char op, const std::string &first, const std::string &last,
+                const std::string &phone_number) {
+        if (fd < 0) {
+            return;
+        }
+        buffer.push_back(op);
+        buffer += "," + Person::encode_field(first) + "," +
+                  Person::encode_field(last) + "," +
+                  Person::encode_field(phone_number) + "," +
+                  std::to_string(checksum(op, first, last, phone_number)) +
+                  "\n";
+        records++;
+        if (++pending >= JOURNAL_GROUP_COMMIT) {
+            sync();
+        }
+    }
+
+    bool sync() {
+        // Write out every buffered record and wait for it to hit the disk.
+        if (fd < 0 || pending == 0) {
+            return true;
+        }
+        if (!write_all(fd, buffer.data(), buffer.length())) {
+            return false;
+        }
+        written += buffer.length();
+        buffer.clear();
+        pending = 0;
+        return fdatasync(fd) == 0;
+    }
+
+    bool reset() {
+        // Drop every record, once they're safely part of a save.
+        buffer.clear();
+        pending = 0;
+        records = 0;
+        written = 0;
+        return fd < 0 || (ftruncate(fd, 0) == 0 && fsync(fd) == 0);
+    }
+
+    size_t mark() {
+        // Where the next record will start on disk. Everything logged so far
+        // is synced first, so a save of the book as it is now covers exactly
+        // the records before the mark.
+        sync();
+        return written;
+    }
+
+    bool drop_before(size_t mark) {
+        // Drop the records before mark once a save covers them, keeping any
+        // logged since. Those are copied into a fresh journal that replaces
+        // this one, so a crash leaves either the old journal or the new.
+        if (fd < 0) {
+            return true;
+        }
+        if (!sync() || mark > written) {
+            return false;
+        }
+        std::string tail(written - mark, '\0');
+        if (!tail.empty() && pread(fd, &tail[0], tail.length(), mark) !=
+                                 ssize_t(tail.length())) {
+            return false;
+        }
+        std::string temporary = path + ".tmp";
+        int tail_fd = ::open(temporary.c_str(),
+                             O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0644);
+        if (tail_fd < 0) {
+            return false;
+        }
+        if (!write_all(tail_fd, tail.data(), tail.length()) ||
+            !replace_file(temporary, path.c_str())) {
+            ::close(tail_fd);
+            std::remove(temporary.c_str());
+            return false;
+        }
+        ::close(fd);
+        fd = tail_fd;
+        written = tail.length();
+        records = std::count(tail.begin(), tail.end(), '\n');
+        return true;
+    }
+
+    static uint32_t checksum(char op, const std::string &first,
+                             const std::string &last,
+                             const std::string &phone_number) {
+        // FNV-1a over the record's fields.
+        std::string record = std::string(1, op) + '\0' + first + '\0' + last +
+                             '\0' + phone_number;
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < record.length(); i++) {
+            hash = (hash ^ static_cast<unsigned char>(record[i])) * 16777619u;
+        }
+        return hash;
+    }
+
+  private:
+    int fd;
+    std::string path;
+    std::string buffer;
+    // Records in the buffer that haven't been written yet.
+    size_t pending;
+    size_t records;
+    // Bytes of records on disk.
+    size_t written;
+};
+
+// On-disk layout of a snapshot file. The header is followed by one record per
+// entry in sorted order and then by a string table holding each record's text
+// exactly as a Person expects it ("LAST\0FIRST\0", plus the phone number when
+// it isn't packed). Everything is stored in native byte order.
+struct Snapshot_Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    // FNV-1a over the records and the string table.
+    uint64_t checksum;
+    uint64_t reserved;
+};
+
+struct Snapshot_Record {
+    uint64_t key_prefix;
+    uint64_t phone_digits;
+    // Where the record's text starts in the string table.
+    uint64_t key_offset;
+    uint16_t last_length;
+    uint16_t first_length;
+    uint32_t reserved;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'P', 'H', 'O', 'N', 'E', 'B', 'K', '\0'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+class Snapshot {
+    // Read-only view of a snapshot file mapped into memory. Opening one only
+    // checks the header, so lookups can be served straight from the mapping
+    // without reading the rest of the file. The checksum covers everything
+    // else and is checked by verify().
+  public:
+    Snapshot() : data(nullptr), length(0), header(nullptr), records(nullptr) {}
+    ~Snapshot() { close(); }
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    bool open(const char *path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 ||
+            static_cast<size_t>(info.st_size) < sizeof(Snapshot_Header)) {
+            ::close(fd);
+            return false;
+        }
+        length = info.st_size;
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping keeps the file alive on its own.
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            length = 0;
+            return false;
+        }
+        data = static_cast<const char *>(mapping);
+        header = reinterpret_cast<const Snapshot_Header *>(data);
+
+        // Make sure every offset in the header stays inside the file, and
+        // that the string table ends in a terminator so no record's text can
+        // run off the end of the mapping.
+        bool valid =
+            std::memcmp(header->magic, SNAPSHOT_MAGIC, 8) == 0 &&
+            header->version == SNAPSHOT_VERSION &&
+            header->record_size == sizeof(Snapshot_Record) &&
+            header->records_offset % alignof(Snapshot_Record) == 0 &&
+            header->records_offset <= length &&
+            header->count <=
+                (length - header->records_offset) / sizeof(Snapshot_Record) &&
+            header->strings_offset <= length &&
+            header->strings_size <= length - header->strings_offset &&
+            header->strings_size > 0 &&
+            data[header->strings_offset + header->strings_size - 1] == '\0';
+        if (!valid) {
+            close();
+            return false;
+        }
+        records = reinterpret_cast<const Snapshot_Record *>(
+            data + header->records_offset);
+        return true;
+    }
+
+    void close() {
+        if (data) {
+            munmap(const_cast<char *>(data), length);
+        }
+        data = nullptr;
+        length = 0;
+        header = nullptr;
+        records = nullptr;
+    }
+
+    bool is_open() const { return data != nullptr; }
+    size_t size() const { return header ? header->count : 0; }
+
+    bool verify() const {
+        return checksum(data + header->records_offset,
+                        header->count * sizeof(Snapshot_Record),
+                        data + header->strings_offset, header->strings_size) ==
+               header->checksum;
+    }
+
+    Person person(size_t i) const {
+        // View the i-th entry in sorted order. Text that would fall outside
+        // the string table comes back as an empty person instead.
+        const Snapshot_Record &record = records[i];
+        size_t needed = size_t(record.last_length) + record.first_length + 2;
+        if (record.key_offset > header->strings_size ||
+            needed > header->strings_size - record.key_offset) {
+            return Person();
+        }
+        return Person(record.key_prefix,
+                      data + header->strings_offset + record.key_offset,
+                      record.last_length, record.first_length,
+                      record.phone_digits);
+    }
+
+    bool find(const Person &probe, Person &result) const {
+        // Binary search over the sorted records.
+        size_t low = 0, high = size();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            Person candidate = person(middle);
+            int direction = Person::compare(probe, candidate);
+            if (direction == 0) {
+                result = candidate;
+                return true;
+            } else if (direction < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return false;
+    }
+
+    size_t lower_bound(const char *key, size_t length, bool inclusive) const {
+        // Index of the first record whose key is at or after key (strictly
+        // after it unless inclusive), or size() if there is none.
+        size_t low = 0, high = size();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            int direction = person(middle).compare_key(key, length);
+            if (direction > 0 || (direction == 0 && inclusive)) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return low;
+    }
+
+    static bool write(const char *path,
+                      const std::vector<Snapshot_Record> &records,
+                      const std::string &strings) {
+        // Write to a temporary file and rename it over path, so anyone with
+        // the old snapshot mapped keeps seeing the old contents.
+        Snapshot_Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+        header.version = SNAPSHOT_VERSION;
+        header.record_size = sizeof(Snapshot_Record);
+        header.count = records.size();
+        header.records_offset = sizeof(Snapshot_Header);
+        header.strings_offset =
+            header.records_offset + records.size() * sizeof(Snapshot_Record);
+        header.strings_size = strings.size();
+        header.checksum =
+            checksum(reinterpret_cast<const char *>(records.data()),
+                     records.size() * sizeof(Snapshot_Record), strings.data(),
+                     strings.size());
+
+        std::string temporary = std::string(path) + ".tmp";
+        std::ofstream File(temporary, std::ios::binary | std::ios::trunc);
+        File.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        File.write(reinterpret_cast<const char *>(records.data()),
+                   records.size() * sizeof(Snapshot_Record));
+        File.write(strings.data(), strings.size());
+        File.close();
+        if (!File) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return replace_file(temporary, path);
+    }
+
+    static uint64_t checksum(const char *records, size_t records_size,
+                             const char *strings, size_t strings_size) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < records_size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(records[i])) *
+                   1099511628211ULL;
+        }
+        for (size_t i = 0; i < strings_size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(strings[i])) *
+                   1099511628211ULL;
+        }
+        return hash;
+    }
+
+  private:
+    const char *data;
+    size_t length;
+    const Snapshot_Header *header;
+    const Snapshot_Record *records;
+};
+
+struct Compressed_Header {
+    char magic[8];
+    uint32_t version;
+    // Entries in every block but the last.
+    uint32_t block_entries;
+    uint64_t count;
+    uint64_t block_count;
+    // The blocks run from the end of the header up to the index.
+    uint64_t index_offset;
+    // FNV-1a over the rest of the header and the index. Each block's own
+    // checksum is in the index.
+    uint64_t checksum;
+};
+
+struct Compressed_Block {
+    uint64_t offset;
+    uint64_t size;
+    // FNV-1a over the block.
+    uint64_t checksum;
+};
+
+constexpr char COMPRESSED_MAGIC[8] = {'P', 'H', 'O', 'N', 'E', 'B', 'K', 'Z'};
+constexpr uint32_t COMPRESSED_VERSION = 1;
+
+class Compressed_File {
+    // Read-only view of a book written as sorted, front-coded blocks. Each
+    // name is stored as how many leading bytes it shares with the name
+    // before it followed by the bytes that differ, and each phone number as
+    // a single integer. Every block starts over with a whole name, and an
+    // index of where the blocks are lets a lookup binary search their first
+    // names and decode just the one block that could hold it. Mapped into
+    // memory like a Snapshot.
+  public:
+    class Reader {
+        // Decodes one block's entries in order.
+      public:
+        // The raw key ("LAST\0FIRST") of the entry just decoded, its packed
+        // phone digits, and the phone number as text when they're zero.
+        std::string key;
+        uint64_t digits;
+        std::string phone_number;
+
+        Reader(const char *begin, const char *end)
+            : digits(0), at(begin), end(end), malformed(false) {}
+
+        bool next() {
+            // Decode the next entry. Returns false at the end of the block,
+            // or at a malformed entry, which failed() then reports.
+            if (at == end) {
+                return false;
+            }
+            uint64_t shared, suffix, code;
+            if (!read_number(shared) || shared > key.size() ||
+                !read_number(suffix) || suffix > size_t(end - at)) {
+                return fail();
+            }
+            // Names only ever increase and share as much as they can with
+            // the one before, so the first byte past the shared part has to
+            // be larger than the one it replaces.
+            if (suffix == 0 ||
+                (shared < key.size() &&
+                 static_cast<unsigned char>(*at) <=
+                     static_cast<unsigned char>(key[shared]))) {
+                return fail();
+            }
+            key.resize(shared);
+            key.append(at, suffix);
+            at += suffix;
+            if (!read_number(code)) {
+                return fail();
+            }
+            phone_number.clear();
+            if (code) {
+                digits = unpack_phone(code);
+                if (!digits) {
+                    return fail();
+                }
+            } else {
+                uint64_t length;
+                if (!read_number(length) || length > size_t(end - at)) {
+                    return fail();
+                }
+                digits = 0;
+                phone_number.assign(at, length);
+                at += length;
+            }
+            return true;
+        }
+
+        bool failed() const { return malformed; }
+
+        bool person(std::string &buffer, Person &result) const {
+            // Lay the entry's text out in buffer the way Person::pack does
+            // and view it as a person. False if the key isn't a valid name.
+            size_t last_length = key.find('\0');
+            if (last_length == std::string::npos ||
+                key.find('\0', last_length + 1) != std::string::npos ||
+                last_length > UINT16_MAX ||
+                key.size() - last_length - 1 > UINT16_MAX ||
+                phone_number.find('\0') != std::string::npos) {
+                return false;
+            }
+            buffer.assign(key);
+            buffer.push_back('\0');
+            if (!digits) {
+                buffer.append(phone_number);
+                buffer.push_back('\0');
+            }
+            result = Person(buffer.data(), last_length,
+                            key.size() - last_length - 1, digits);
+            return true;
+        }
+
+      private:
+        const char *at;
+        const char *end;
+        bool malformed;
+
+        bool read_number(uint64_t &value) {
+            return Compressed_File::read_number(at, end, value);
+        }
+
+        bool fail() {
+            malformed = true;
+            return false;
+        }
+    };
+
+    Compressed_File()
+        : data(nullptr), length(0), header(nullptr), blocks(nullptr) {}
+    ~Compressed_File() { close(); }
+
+    Compressed_File(const Compressed_File &) = delete;
+    Compressed_File &operator=(const Compressed_File &) = delete;
+
+    bool open(const char *path) {
+        // Map the file and check its header and index. The blocks are only
+        // checked as they're read.
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 ||
+            static_cast<size_t>(info.st_size) < sizeof(Compressed_Header)) {
+            ::close(fd);
+            return false;
+        }
+        length = info.st_size;
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            length = 0;
+            return false;
+        }
+        data = static_cast<const char *>(mapping);
+        header = reinterpret_cast<const Compressed_Header *>(data);
+
+        bool valid =
+            std::memcmp(header->magic, COMPRESSED_MAGIC, 8) == 0 &&
+            header->version == COMPRESSED_VERSION &&
+            header->block_entries > 0 &&
+            header->index_offset >= sizeof(Compressed_Header) &&
+            header->index_offset % alignof(Compressed_Block) == 0 &&
+            header->index_offset <= length &&
+            header->block_count == (length - header->index_offset) /
+                                       sizeof(Compressed_Block) &&
+            header->count <= header->block_count * header->block_entries &&
+            header->count + header->block_entries >
+                header->block_count * header->block_entries &&
+            header_checksum(*header, data + header->index_offset) ==
+                header->checksum;
+        if (valid) {
+            blocks = reinterpret_cast<const Compressed_Block *>(
+                data + header->index_offset);
+            for (size_t i = 0; i < header->block_count && valid; i++) {
+                valid = blocks[i].offset >= sizeof(Compressed_Header) &&
+                        blocks[i].offset <= header->index_offset &&
+                        blocks[i].size > 0 &&
+                        blocks[i].size <=
+                            header->index_offset - blocks[i].offset;
+            }
+        }
+        if (!valid) {
+            close();
+        }
+        return valid;
+    }
+
+    void close() {
+        if (data) {
+            munmap(const_cast<char *>(data), length);
+        }
+        data = nullptr;
+        length = 0;
+        header = nullptr;
+        blocks = nullptr;
+    }
+
+    bool is_open() const { return data != nullptr; }
+    size_t size() const { return header ? header->count : 0; }
+    size_t block_count() const { return header ? header->block_count : 0; }
+
+    bool verify_block(size_t i) const {
+        return checksum(data + blocks[i].offset, blocks[i].size) ==
+               blocks[i].checksum;
+    }
+
+    Reader block(size_t i) const {
+        // Read block i, which should have been verified first.
+        return Reader(data + blocks[i].offset,
+                      data + blocks[i].offset + blocks[i].size);
+    }
+
+    bool find(const char *key, size_t key_length, std::string &buffer,
+              Person &result) const {
+        // Look up a raw key. The block it would be in is the last one whose
+        // first name isn't after it, and only that block gets decoded. On
+        // success result views its text in buffer.
+        size_t low = 0, high = block_count();
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            // A block's first name is whole, so it's compared where it lies
+            // in the mapping without decoding anything.
+            const char *first = data + blocks[middle].offset;
+            const char *end = first + blocks[middle].size;
+            uint64_t shared, first_length;
+            if (!read_number(first, end, shared) ||
+                !read_number(first, end, first_length) || shared != 0 ||
+                first_length > size_t(end - first)) {
+                first_length = 0;
+            }
+            if (Person::compare_text(first, first_length, key, key_length) <=
+                0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low == 0 || !verify_block(low - 1)) {
+            return false;
+        }
+        Reader reader = block(low - 1);
+        while (reader.next()) {
+            int direction = Person::compare_text(
+                reader.key.data(), reader.key.size(), key, key_length);
+            if (direction == 0) {
+                return reader.person(buffer, result);
+            } else if (direction > 0) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    static bool write(const char *path,
+                      const std::vector<const Person *> &sorted,
+                      size_t block_entries) {
+        // Write people, sorted and unique, to a temporary file and rename it
+        // over path.
+        std::string out(sizeof(Compressed_Header), '\0');
+        std::vector<Compressed_Block> index;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            const Person &p = *sorted[i];
+            size_t shared = 0;
+            if (i % block_entries == 0) {
+                if (!index.empty()) {
+                    close_block(index.back(), out);
+                }
+                index.push_back(Compressed_Block{out.size(), 0, 0});
+            } else {
+                const Person &previous = *sorted[i - 1];
+                size_t limit =
+                    std::min(previous.key_length(), p.key_length());
+                while (shared < limit &&
+                       previous.key[shared] == p.key[shared]) {
+                    shared++;
+                }
+            }
+            write_number(shared, out);
+            write_number(p.key_length() - shared, out);
+            out.append(p.key + shared, p.key_length() - shared);
+            write_number(pack_phone(p.phone_digits), out);
+            if (!p.phone_digits) {
+                const char *phone_number = p.first_data() + p.first_length + 1;
+                size_t phone_length = std::strlen(phone_number);
+                write_number(phone_length, out);
+                out.append(phone_number, phone_length);
+            }
+        }
+        if (!index.empty()) {
+            close_block(index.back(), out);
+        }
+        out.resize((out.size() + alignof(Compressed_Block) - 1) /
+                   alignof(Compressed_Block) * alignof(Compressed_Block));
+
+        Compressed_Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, COMPRESSED_MAGIC, 8);
+        header.version = COMPRESSED_VERSION;
+        header.block_entries = block_entries;
+        header.count = sorted.size();
+        header.block_count = index.size();
+        header.index_offset = out.size();
+        header.checksum = header_checksum(
+            header, reinterpret_cast<const char *>(index.data()));
+        std::memcpy(&out[0], &header, sizeof(header));
+
+        std::string temporary = std::string(path) + ".tmp";
+        std::ofstream File(temporary, std::ios::binary | std::ios::trunc);
+        File.write(out.data(), out.size());
+        File.write(reinterpret_cast<const char *>(index.data()),
+                   index.size() * sizeof(Compressed_Block));
+        File.close();
+        if (!File) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return replace_file(temporary, path);
+    }
+
+  private:
+    const char *data;
+    size_t length;
+    const Compressed_Header *header;
+    const Compressed_Block *blocks;
+
+    static void close_block(Compressed_Block &block, const std::string &out) {
+        block.size = out.size() - block.offset;
+        block.checksum = checksum(out.data() + block.offset, block.size);
+    }
+
+    static bool read_number(const char *&at, const char *end,
+                            uint64_t &value) {
+        // A little-endian base-128 number, seven bits a byte.
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (at == end) {
+                return false;
+            }
+            unsigned char byte = *at++;
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void write_number(uint64_t value, std::string &out) {
+        while (value >= 0x80) {
+            out += static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    static uint64_t pack_phone(uint64_t digits) {
+        // Read the digit nibbles (each digit plus one) as a number in base
+        // 11, which comes to five bytes for ten digits where the nibbles
+        // would take six. Zero stands for a phone number kept as text.
+        uint64_t code = 0;
+        for (int shift = 60; shift >= 0 && (digits >> shift & 0xF);
+             shift -= 4) {
+            code = code * 11 + (digits >> shift & 0xF);
+        }
+        return code;
+    }
+
+    static uint64_t unpack_phone(uint64_t code) {
+        // The digit nibbles back from pack_phone, or zero if code can't
+        // have come from it.
+        uint64_t nibbles[16];
+        size_t count = 0;
+        while (code) {
+            if (code % 11 == 0 || count == 16) {
+                return 0;
+            }
+            nibbles[count++] = code % 11;
+            code /= 11;
+        }
+        uint64_t digits = 0;
+        for (size_t i = 0; i < count; i++) {
+            digits |= nibbles[count - 1 - i] << (60 - 4 * i);
+        }
+        return digits;
+    }
+
+    static uint64_t header_checksum(const Compressed_Header &header,
+                                    const char *index) {
+        return checksum(index, header.block_count * sizeof(Compressed_Block),
+                        checksum(reinterpret_cast<const char *>(&header),
+                                 offsetof(Compressed_Header, checksum)));
+    }
+
+    static uint64_t checksum(const char *bytes, size_t size,
+                             uint64_t hash = 14695981039346656037ULL) {
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(bytes[i])) *
+                   1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+class Save_Index {
+    // Where every record of a save file starts, keyed by a hash of its name,
+    // so single entries can be read straight out of the file before the
+    // whole of it has been loaded. Save files are written in tree order
+    // rather than name order (see Book::write_text), so every record has to
+    // be indexed; the snapshot is the sorted alternative.
+  public:
+    Save_Index() : data(nullptr), length(0) {}
+    ~Save_Index() { close(); }
+
+    Save_Index(const Save_Index &) = delete;
+    Save_Index &operator=(const Save_Index &) = delete;
+
+    bool open(const char *path) {
+        // Map the file and index it in one pass.
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        length = info.st_size;
+        // Private and writable only so the parser's pointers can be char *.
+        // Records are copied before they're parsed, so nothing is written.
+        void *mapping =
+            mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            length = 0;
+            return false;
+        }
+        data = static_cast<char *>(mapping);
+        std::string record;
+        Field fields[3];
+        size_t offset = 0;
+        while (offset < length) {
+            size_t next;
+            if (read(offset, record, fields, next)) {
+                entries.push_back(Entry{hash(fields[1], fields[0]), offset});
+            }
+            offset = next;
+        }
+        std::sort(entries.begin(), entries.end());
+        return true;
+    }
+
+    void close() {
+        if (data) {
+            munmap(data, length);
+        }
+        data = nullptr;
+        length = 0;
+        std::vector<Entry>().swap(entries);
+    }
+
+    bool is_open() const { return data != nullptr; }
+    // Records indexed, duplicate names included.
+    size_t size() const { return entries.size(); }
+
+    bool find(const std::string &first, const std::string &last,
+              std::string &buffer, Person &result) const {
+        // Look up an uppercased name. Like loading the file, the first record
+        // with the name wins. result views its text in buffer.
+        Field name[2];
+        name[0].data = const_cast<char *>(first.data());
+        name[0].length = first.length();
+        name[1].data = const_cast<char *>(last.data());
+        name[1].length = last.length();
+        Entry probe{hash(name[1], name[0]), 0};
+        std::string record;
+        Field fields[3];
+        for (auto it = std::lower_bound(entries.begin(), entries.end(), probe);
+             it != entries.end() && it->hash == probe.hash; ++it) {
+            size_t next;
+            if (read(it->offset, record, fields, next) &&
+                fields[0].str() == first && fields[1].str() == last) {
+                result = Person::pack(fields[0].data, fields[0].length,
+                                      fields[1].data, fields[1].length,
+                                      fields[2].data, fields[2].length, buffer);
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    struct Entry {
+        uint64_t hash;
+        size_t offset;
+        bool operator<(const Entry &other) const {
+            return hash != other.hash ? hash < other.hash
+                                      : offset < other.offset;
+        }
+    };
+
+    char *data;
+    size_t length;
+    // Sorted by hash, and by where the record is for equal hashes.
+    std::vector<Entry> entries;
+
+    bool read(size_t offset, std::string &record, Field *fields,
+              size_t &next) const {
+        // Split a copy of the record at offset into fields with the names
+        // uppercased, as loading would, and set next to where the record
+        // after it starts. False for a record loading would skip.
+        size_t newlines = 0;
+        char *end =
+            CSV_Parser::find_record_end(data + offset, data + length, newlines);
+        next = end - data + (end < data + length);
+        record.assign(data + offset, end);
+        if (CSV_Parser::parse_record(&record[0], &record[0] + record.size(),
+                                     fields, 3) ||
+            fields[0].length > UINT16_MAX || fields[1].length > UINT16_MAX) {
+            return false;
+        }
+        std::transform(fields[0].data, fields[0].data + fields[0].length,
+                       fields[0].data, ::toupper);
+        std::transform(fields[1].data, fields[1].data + fields[1].length,
+                       fields[1].data, ::toupper);
+        return true;
+    }
+
+    static uint64_t hash(const Field &last, const Field &first) {
+        // FNV-1a over the name's key bytes, "LAST\0FIRST".
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < last.length; i++) {
+            hash = (hash ^ static_cast<unsigned char>(last.data[i])) *
+                   1099511628211ULL;
+        }
+        hash *= 1099511628211ULL;
+        for (size_t i = 0; i < first.length; i++) {
+            hash = (hash ^ static_cast<unsigned char>(first.data[i])) *
+                   1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+class BST_Node {
+  public:
+    Person person;
+    BST_Node *left;
+    BST_Node *right;
+    BST_Node *parent;
+    // Height of the subtree rooted at this node. Leaves have a height of 1.
+    int height;
+    // Number of nodes in the subtree rooted at this node, which lets the
+    // tree find the n-th entry or the position of a name in O(log n). 32 bits
+    // fill the padding after height, so the node doesn't grow.
+    uint32_t size;
+
+    BST_Node(const Person &person)
+        : person(person), left(nullptr), right(nullptr), parent(nullptr),
+          height(1), size(1) {}
+};
+
+// Clearing a book skips destructors entirely, so keep it that way.
+static_assert(std::is_trivially_destructible<BST_Node>::value,
+              "BST_Node must be trivially destructible");
+
+class Node_Pool {
+    // Slab allocator for BST_Nodes. Nodes are carved out of large contiguous
+    // blocks so that loading a book costs a handful of heap allocations
+    // instead of one per entry, and neighbouring entries tend to share cache
+    // lines. Released nodes go on a free list and are handed out again before
+    // any new block is touched.
+  public:
+    Node_Pool() : free_list(nullptr), next_slot(NODE_POOL_BLOCK_SIZE) {}
+    ~Node_Pool() { release_all(); }
+
+    // The pool owns raw memory, so it can't be copied.
+    Node_Pool(const Node_Pool &) = delete;
+    Node_Pool &operator=(const Node_Pool &) = delete;
+
+    BST_Node *acquire(const Person &person) {
+        void *slot;
+        if (free_list) {
+            // Recycle a slot from a deleted node first.
+            slot = free_list;
+            free_list = free_list->next;
+        } else {
+            if (next_slot == NODE_POOL_BLOCK_SIZE) {
+                // The current block is full, grab a new one.
+                blocks.push_back(static_cast<Slot *>(
+                    ::operator new(sizeof(Slot) * NODE_POOL_BLOCK_SIZE)));
+                next_slot = 0;
+            }
+            slot = &blocks.back()[next_slot++];
+        }
+        return new (slot) BST_Node(person);
+    }
+
+    void release(BST_Node *node) {
+        // Destroy the node and push its slot onto the free list.
+        node->~BST_Node();
+        Slot *slot = reinterpret_cast<Slot *>(node);
+        slot->next = free_list;
+        free_list = slot;
+    }
+
+    void release_all() {
+        // Hand every block back at once. Any nodes still living in them must
+        // already have been destroyed.
+        for (size_t i = 0; i < blocks.size(); i++) {
+            ::operator delete(blocks[i]);
+        }
+        blocks.clear();
+        free_list = nullptr;
+        next_slot = NODE_POOL_BLOCK_SIZE;
+    }
+
+    // Bytes held in all the blocks.
+    size_t bytes() const {
+        return blocks.size() * NODE_POOL_BLOCK_SIZE * sizeof(Slot);
+    }
+
+    void adopt(Node_Pool &other) {
+        // Take over every block (and free slot) of other, leaving it empty.
+        // Nodes living in other's blocks now belong to this pool.
+        blocks.insert(blocks.begin(), other.blocks.begin(), other.blocks.end());
+        while (other.free_list) {
+            Slot *slot = other.free_list;
+            other.free_list = slot->next;
+            slot->next = free_list;
+            free_list = slot;
+        }
+        other.blocks.clear();
+        other.release_all();
+    }
+
+  private:
+    union Slot {
+        Slot *next;
+        alignas(BST_Node) unsigned char storage[sizeof(BST_Node)];
+    };
+
+    std::vector<Slot *> blocks;
+    Slot *free_list;
+    // Index of the next untouched slot in the newest block.
+    size_t next_slot;
+};
+
+template <typename Node> class Tree_Cursor {
+    // Walks a tree one node per call to next() using an explicit stack rather
+    // than recursion, so a degenerate tree costs heap space instead of
+    // overflowing the call stack. Every traversal in Book goes through here,
+    // over BST_Nodes or over the Version_Nodes of a frozen version.
+  public:
+    enum Order { INORDER, PREORDER, POSTORDER };
+
+    Tree_Cursor(Node *root, Order order) : order(order) {
+        if (!root) {
+            return;
+        }
+        if (order == INORDER) {
+            push_left_spine(root);
+        } else if (order == PREORDER) {
+            stack.push_back(root);
+        } else {
+            push_first_leaf(root);
+        }
+    }
+
+    Tree_Cursor(Node *root, const char *key, size_t length, bool inclusive)
+        : order(INORDER) {
+        // In order, starting from the first node whose key is at or after key
+        // (strictly after it unless inclusive). Only the path down to that
+        // node goes on the stack: every node we step left from is still to
+        // come, and every node we step right from is already behind us.
+        while (root) {
+            int direction = root->person.compare_key(key, length);
+            if (direction > 0 || (direction == 0 && inclusive)) {
+                stack.push_back(root);
+                root = root->left;
+            } else {
+                root = root->right;
+            }
+        }
+    }
+
+    Node *next() {
+        // Returns the next node in the requested order, nullptr once done.
+        if (stack.empty()) {
+            return nullptr;
+        }
+        Node *ptr = stack.back();
+        stack.pop_back();
+
+        if (order == INORDER) {
+            // Everything left of ptr has been visited, so continue with the
+            // leftmost path of its right subtree.
+            push_left_spine(ptr->right);
+        } else if (order == PREORDER) {
+            // Push right first so the left subtree comes off the stack first.
+            if (ptr->right) {
+                stack.push_back(ptr->right);
+            }
+            if (ptr->left) {
+                stack.push_back(ptr->left);
+            }
+        } else if (!stack.empty()) {
+            // Post order. If we just finished the parent's left subtree, its
+            // right subtree comes next. ptr's children are never touched again
+            // once ptr is handed out, so the caller is free to delete it.
+            Node *parent = stack.back();
+            if (parent->left == ptr && parent->right) {
+                push_first_leaf(parent->right);
+            }
+        }
+        return ptr;
+    }
+
+  private:
+    Order order;
+    std::vector<Node *> stack;
+
+    void push_left_spine(Node *ptr) {
+        while (ptr) {
+            stack.push_back(ptr);
+            ptr = ptr->left;
+        }
+    }
+
+    void push_first_leaf(Node *ptr) {
+        // Descend to the first node post order would visit, preferring left
+        // children over right ones.
+        while (ptr) {
+            stack.push_back(ptr);
+            ptr = ptr->left ? ptr->left : ptr->right;
+        }
+    }
+};
+
+typedef Tree_Cursor<BST_Node> BST_Cursor;
+
+class Trigram_Index {
+    // Typo-tolerant search over "LAST,FIRST" keys. Every run of three
+    // characters in a key maps to the nodes containing it. Names a few edits
+    // apart share most of their trigrams, so only the entries sharing the
+    // most trigrams with a query get the (comparatively expensive) edit
+    // distance computed. The index is built the first time it's searched and
+    // kept up to date from then on; until then add() and remove() do nothing.
+  public:
+    Trigram_Index() : built(false) {}
+
+    bool is_built() const { return built; }
+
+    void build(const std::vector<BST_Node *> &nodes) {
+        clear();
+        built = true;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            add(nodes[i]);
+        }
+    }
+
+    void clear() {
+        postings.clear();
+        positions.clear();
+        built = false;
+    }
+
+    void add(BST_Node *node) {
+        if (!built) {
+            return;
+        }
+        std::vector<uint32_t> grams;
+        trigrams(padded_key(node->person), grams);
+        std::vector<uint32_t> &places = positions[node];
+        places.resize(grams.size());
+        for (size_t i = 0; i < grams.size(); i++) {
+            std::vector<Posting> &list = postings[grams[i]];
+            places[i] = uint32_t(list.size());
+            list.push_back(Posting{node, uint32_t(i)});
+        }
+    }
+
+    void remove(BST_Node *node) {
+        if (!built) {
+            return;
+        }
+        auto places = positions.find(node);
+        if (places == positions.end()) {
+            return;
+        }
+        std::vector<uint32_t> grams;
+        trigrams(padded_key(node->person), grams);
+        for (size_t i = 0; i < grams.size(); i++) {
+            auto list = postings.find(grams[i]);
+            if (list == postings.end()) {
+                continue;
+            }
+            // Order within a posting list doesn't matter, so move the last
+            // posting into the node's place rather than shifting everything
+            // after it, and tell the moved node where it went.
+            std::vector<Posting> &entries = list->second;
+            uint32_t place = places->second[i];
+            entries[place] = entries.back();
+            positions[entries[place].node][entries[place].slot] = place;
+            entries.pop_back();
+            if (entries.empty()) {
+                postings.erase(list);
+            }
+        }
+        positions.erase(places);
+    }
+
+    std::vector<BST_Node *> search(const std::string &query,
+                                   size_t limit) const {
+        // Up to limit of the closest entries to an uppercase query, closest
+        // first and alphabetical among equals. Given as "LAST" the query is
+        // matched against last names alone, as "LAST,FIRST" against both.
+        bool whole_key = query.find(',') != std::string::npos;
+        std::vector<uint32_t> grams;
+        trigrams(std::string("\1") + query + (whole_key ? "\1" : ","), grams);
+
+        // Count the trigrams each entry shares with the query by sorting the
+        // query's posting lists together and measuring runs of the same node,
+        // which beats hashing every posting.
+        std::vector<BST_Node *> hits;
+        for (size_t i = 0; i < grams.size(); i++) {
+            auto list = postings.find(grams[i]);
+            if (list == postings.end()) {
+                continue;
+            }
+            for (size_t j = 0; j < list->second.size(); j++) {
+                hits.push_back(list->second[j].node);
+            }
+        }
+        std::sort(hits.begin(), hits.end());
+        std::vector<std::pair<unsigned, BST_Node *>> candidates;
+        for (size_t i = 0; i < hits.size();) {
+            size_t run = i + 1;
+            while (run < hits.size() && hits[run] == hits[i]) {
+                run++;
+            }
+            candidates.push_back(std::make_pair(unsigned(run - i), hits[i]));
+            i = run;
+        }
+        if (candidates.size() > FUZZY_CANDIDATES) {
+            std::nth_element(
+                candidates.begin(), candidates.begin() + FUZZY_CANDIDATES,
+                candidates.end(),
+                [](const std::pair<unsigned, BST_Node *> &a,
+                   const std::pair<unsigned, BST_Node *> &b) {
+                    return a.first > b.first;
+                });
+            candidates.resize(FUZZY_CANDIDATES);
+        }
+
+        // Rank what's left by edit distance.
+        std::vector<std::pair<int, BST_Node *>> ranked;
+        std::string target;
+        for (size_t i = 0; i < candidates.size(); i++) {
+            const Person &p = candidates[i].second->person;
+            target.assign(p.last_data(), p.last_length);
+            if (whole_key) {
+                target.push_back(',');
+                target.append(p.first_data(), p.first_length);
+            }
+            int distance = edit_distance(query, target, FUZZY_MAX_DISTANCE);
+            if (distance <= FUZZY_MAX_DISTANCE) {
+                ranked.push_back(
+                    std::make_pair(distance, candidates[i].second));
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(),
+                  [](const std::pair<int, BST_Node *> &a,
+                     const std::pair<int, BST_Node *> &b) {
+                      if (a.first != b.first) {
+                          return a.first < b.first;
+                      }
+                      return Person::compare(a.second->person,
+                                             b.second->person) < 0;
+                  });
+        std::vector<BST_Node *> results;
+        for (size_t i = 0; i < ranked.size() && i < limit; i++) {
+            results.push_back(ranked[i].second);
+        }
+        return results;
+    }
+
+    static int edit_distance(const std::string &a, const std::string &b,
+                             int limit) {
+        // Levenshtein distance, or limit + 1 as soon as it's sure to be over
+        // limit. Only two rows of the table are kept.
+        if (std::abs(int(a.length()) - int(b.length())) > limit) {
+            return limit + 1;
+        }
+        std::vector<int> previous(b.length() + 1), current(b.length() + 1);
+        for (size_t j = 0; j <= b.length(); j++) {
+            previous[j] = j;
+        }
+        for (size_t i = 1; i <= a.length(); i++) {
+            current[0] = i;
+            int row_minimum = current[0];
+            for (size_t j = 1; j <= b.length(); j++) {
+                int substitution =
+                    previous[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+                current[j] = std::min(
+                    substitution, std::min(previous[j], current[j - 1]) + 1);
+                row_minimum = std::min(row_minimum, current[j]);
+            }
+            if (row_minimum > limit) {
+                return limit + 1;
+            }
+            previous.swap(current);
+        }
+        return std::min(previous[b.length()], limit + 1);
+    }
+
+  private:
+    struct Posting {
+        // A node, and which of its trigrams (in sorted order) this is.
+        BST_Node *node;
+        uint32_t slot;
+    };
+
+    bool built;
+    std::unordered_map<uint32_t, std::vector<Posting>> postings;
+    // Where each node sits in the posting list of each of its trigrams, so
+    // remove() goes straight to it instead of searching the list.
+    std::unordered_map<BST_Node *, std::vector<uint32_t>> positions;
+
+    static std::string padded_key(const Person &p) {
+        // The key with a marker at either end, so the start and end of the
+        // name count towards matching.
+        std::string key = "\1";
+        key.append(p.last_data(), p.last_length);
+        key.push_back(',');
+        key.append(p.first_data(), p.first_length);
+        key.push_back('\1');
+        return key;
+    }
+
+    static void trigrams(const std::string &text,
+                         std::vector<uint32_t> &grams) {
+        // Every distinct run of three bytes in text.
+        grams.clear();
+        for (size_t i = 0; i + 3 <= text.length(); i++) {
+            grams.push_back(uint32_t(uint8_t(text[i])) << 16 |
+                            uint32_t(uint8_t(text[i + 1])) << 8 |
+                            uint8_t(text[i + 2]));
+        }
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+    }
+};
+
+class Version_Node {
+    // One node of the persistent tree behind Book::Version. A node never
+    // changes once made: an update copies the path from the root down to the
+    // change and shares every other node with the versions before it. Each
+    // node counts the parents and versions holding it, and is freed by
+    // whichever of them lets go last, on any thread.
+  public:
+    Person person;
+    const Version_Node *left;
+    const Version_Node *right;
+    int height;
+    mutable std::atomic<uint32_t> references;
+
+    Version_Node(const Person &person, const Version_Node *left,
+                 const Version_Node *right, int height)
+        : person(person), left(left), right(right), height(height),
+          references(1) {}
+};
+
+class Version_Tree {
+    // The newest root of the persistent tree, kept in step with a book's own
+    // tree. Like the trigram index it's only built the first time it's
+    // needed, and until then the updates do nothing. Updates recurse, but
+    // only as deep as the tree is high, which AVL keeps logarithmic.
+  public:
+    Version_Tree() : head(nullptr), built(false) {}
+    ~Version_Tree() { clear(); }
+
+    Version_Tree(const Version_Tree &) = delete;
+    Version_Tree &operator=(const Version_Tree &) = delete;
+
+    bool is_built() const { return built; }
+
+    // The newest root, with a reference taken for the caller.
+    const Version_Node *root() const { return retain(head); }
+
+    void build(const std::vector<BST_Node *> &sorted) {
+        // Start from the book's nodes, in name order.
+        clear();
+        std::vector<const Person *> people(sorted.size());
+        for (size_t i = 0; i < sorted.size(); i++) {
+            people[i] = &sorted[i]->person;
+        }
+        head = build(people, 0, people.size());
+        built = true;
+    }
+
+    void insert(const Person &p) {
+        // Add p, or put it in place of the entry with the same name.
+        if (built) {
+            replace_head(insert(head, p));
+        }
+    }
+
+    void remove(const Person &p) {
+        if (built) {
+            replace_head(remove(head, p));
+        }
+    }
+
+    void clear() {
+        release(head);
+        head = nullptr;
+        built = false;
+    }
+
+    static const Version_Node *retain(const Version_Node *node) {
+        if (node) {
+            node->references.fetch_add(1, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    static void release(const Version_Node *node) {
+        // Drop a reference, freeing every node nothing else holds any more.
+        // Freed nodes' children wait on a stack rather than in recursive
+        // calls, since a whole version can go at once.
+        std::vector<const Version_Node *> garbage;
+        if (node) {
+            garbage.push_back(node);
+        }
+        while (!garbage.empty()) {
+            node = garbage.back();
+            garbage.pop_back();
+            if (node->references.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                continue;
+            }
+            if (node->left) {
+                garbage.push_back(node->left);
+            }
+            if (node->right) {
+                garbage.push_back(node->right);
+            }
+            delete node;
+        }
+    }
+
+  private:
+    const Version_Node *head;
+    bool built;
+
+    void replace_head(const Version_Node *node) {
+        release(head);
+        head = node;
+    }
+
+    static int height(const Version_Node *node) {
+        return node ? node->height : 0;
+    }
+
+    static const Version_Node *make(const Person &p, const Version_Node *left,
+                                    const Version_Node *right) {
+        // A new node with references of its own to its children. The caller
+        // holds the only reference to it.
+        return new Version_Node(p, retain(left), retain(right),
+                                1 + std::max(height(left), height(right)));
+    }
+
+    static const Version_Node *build(const std::vector<const Person *> &people,
+                                     size_t begin, size_t end) {
+        // A balanced tree of sorted people, middle first.
+        if (begin == end) {
+            return nullptr;
+        }
+        size_t middle = begin + (end - begin) / 2;
+        const Version_Node *left = build(people, begin, middle);
+        const Version_Node *right = build(people, middle + 1, end);
+        const Version_Node *node = make(*people[middle], left, right);
+        release(left);
+        release(right);
+        return node;
+    }
+
+    static const Version_Node *balance(const Person &p,
+                                       const Version_Node *left,
+                                       const Version_Node *right) {
+        // A node for p over left and right, rotated (as new nodes) if their
+        // heights differ by more than one.
+        int difference = height(left) - height(right);
+        if (difference > 1) {
+            if (height(left->left) >= height(left->right)) {
+                const Version_Node *lower = make(p, left->right, right);
+                const Version_Node *top = make(left->person, left->left, lower);
+                release(lower);
+                return top;
+            }
+            const Version_Node *pivot = left->right;
+            const Version_Node *lower_left =
+                make(left->person, left->left, pivot->left);
+            const Version_Node *lower_right = make(p, pivot->right, right);
+            const Version_Node *top =
+                make(pivot->person, lower_left, lower_right);
+            release(lower_left);
+            release(lower_right);
+            return top;
+        } else if (difference < -1) {
+            if (height(right->right) >= height(right->left)) {
+                const Version_Node *lower = make(p, left, right->left);
+                const Version_Node *top =
+                    make(right->person, lower, right->right);
+                release(lower);
+                return top;
+            }
+            const Version_Node *pivot = right->left;
+            const Version_Node *lower_left = make(p, left, pivot->left);
+            const Version_Node *lower_right =
+                make(right->person, pivot->right, right->right);
+            const Version_Node *top =
+                make(pivot->person, lower_left, lower_right);
+            release(lower_left);
+            release(lower_right);
+            return top;
+        }
+        return make(p, left, right);
+    }
+
+    static const Version_Node *insert(const Version_Node *node,
+                                      const Person &p) {
+        if (!node) {
+            return make(p, nullptr, nullptr);
+        }
+        int direction = Person::compare(p, node->person);
+        if (direction == 0) {
+            return make(p, node->left, node->right);
+        }
+        const Version_Node *child, *result;
+        if (direction < 0) {
+            child = insert(node->left, p);
+            result = balance(node->person, child, node->right);
+        } else {
+            child = insert(node->right, p);
+            result = balance(node->person, node->left, child);
+        }
+        release(child);
+        return result;
+    }
+
+    static const Version_Node *remove(const Version_Node *node,
+                                      const Person &p) {
+        if (!node) {
+            return nullptr;
+        }
+        int direction = Person::compare(p, node->person);
+        const Version_Node *child, *result;
+        if (direction < 0) {
+            child = remove(node->left, p);
+            result = balance(node->person, child, node->right);
+        } else if (direction > 0) {
+            child = remove(node->right, p);
+            result = balance(node->person, node->left, child);
+        } else if (!node->left || !node->right) {
+            return retain(node->left ? node->left : node->right);
+        } else {
+            // The next entry up takes the removed one's place. The old node
+            // stays alive (node still holds it) while its copy is made.
+            const Version_Node *next = node->right;
+            while (next->left) {
+                next = next->left;
+            }
+            child = remove(node->right, next->person);
+            result = balance(next->person, node->left, child);
+        }
+        release(child);
+        return result;
+    }
+};
+
+class Book_Lock {
+    // Reader-writer lock for a thread-safe Book, split into stripes that each
+    // sit on their own cache line. A reader only locks the stripe assigned to
+    // its thread, so lookups on different cores never contend for the same
+    // cache line. A writer locks every stripe in order. When the book isn't
+    // thread-safe the lock is disabled and guards cost a branch.
+  public:
+    explicit Book_Lock(bool enabled) : enabled(enabled) {
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+#if defined(__GLIBC__)
+        // Don't let a steady stream of lookups starve writers.
+        pthread_rwlockattr_setkind_np(
+            &attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        for (size_t i = 0; i < LOCK_STRIPES; i++) {
+            pthread_rwlock_init(&stripes[i].lock, &attributes);
+        }
+        pthread_rwlockattr_destroy(&attributes);
+    }
+
+    ~Book_Lock() {
+        for (size_t i = 0; i < LOCK_STRIPES; i++) {
+            pthread_rwlock_destroy(&stripes[i].lock);
+        }
+    }
+
+    Book_Lock(const Book_Lock &) = delete;
+    Book_Lock &operator=(const Book_Lock &) = delete;
+
+    bool is_enabled() const { return enabled; }
+
+    class Guard {
+        // Holds the lock for the rest of the scope. Book's public methods call
+        // each other, so a thread that already holds the lock doesn't take it
+        // again. Asking for the exclusive lock while only holding the shared
+        // one would deadlock, so that throws instead.
+      public:
+        Guard(Book_Lock &lock, bool exclusive)
+            : taken(nullptr), exclusive(exclusive), previous(held),
+              previous_exclusive(held_exclusive) {
+            if (!lock.enabled) {
+                return;
+            }
+            if (held == &lock) {
+                if (exclusive && !held_exclusive) {
+                    throw std::logic_error(
+                        "Error: Book lock can't be upgraded to exclusive");
+                }
+                return;
+            }
+            taken = &lock;
+            if (exclusive) {
+                for (size_t i = 0; i < LOCK_STRIPES; i++) {
+                    pthread_rwlock_wrlock(&lock.stripes[i].lock);
+                }
+            } else {
+                pthread_rwlock_rdlock(&lock.stripes[stripe()].lock);
+            }
+            held = &lock;
+            held_exclusive = exclusive;
+        }
+
+        ~Guard() {
+            if (!taken) {
+                return;
+            }
+            if (exclusive) {
+                for (size_t i = LOCK_STRIPES; i-- > 0;) {
+                    pthread_rwlock_unlock(&taken->stripes[i].lock);
+                }
+            } else {
+                pthread_rwlock_unlock(&taken->stripes[stripe()].lock);
+            }
+            held = previous;
+            held_exclusive = previous_exclusive;
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+      private:
+        Book_Lock *taken;
+        bool exclusive;
+        // The lock this thread held before, restored on the way out.
+        const Book_Lock *previous;
+        bool previous_exclusive;
+    };
+
+  private:
+    struct alignas(64) Stripe {
+        pthread_rwlock_t lock;
+    };
+
+    bool enabled;
+    Stripe stripes[LOCK_STRIPES];
+
+    // The lock the current thread holds, if any.
+    static thread_local const Book_Lock *held;
+    static thread_local bool held_exclusive;
+
+    static size_t stripe() {
+        // Threads are dealt stripes round robin the first time they read.
+        static std::atomic<size_t> next_stripe(0);
+        static thread_local size_t assigned = next_stripe++ % LOCK_STRIPES;
+        return assigned;
+    }
+};
+
+thread_local const Book_Lock *Book_Lock::held = nullptr;
+thread_local bool Book_Lock::held_exclusive = false;
+
+class Metrics {
+    // Call counts, latency histograms and key comparisons for each kind of
+    // Book operation. Counters are relaxed atomics, so readers of a
+    // thread-safe book record without taking any lock. With COLLECT_METRICS
+    // off, scopes and comparison counting do nothing.
+  public:
+    enum Operation {
+        ADD,
+        FIND,
+        CHANGE,
+        DELETE,
+        PHONE,
+        FUZZY,
+        RANGE,
+        RANK,
+        SAVE,
+        LOAD,
+        OPERATION_COUNT
+    };
+
+    Metrics() {
+        for (size_t op = 0; op < OPERATION_COUNT; op++) {
+            Counters &c = counters[op];
+            c.calls = 0;
+            c.nanoseconds = 0;
+            c.max_nanoseconds = 0;
+            c.comparisons = 0;
+            for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                c.histogram[b] = 0;
+            }
+        }
+    }
+
+    class Scope {
+        // Records one operation from construction to destruction, lock waits
+        // included. Book's public methods call each other, so only the
+        // outermost scope on a thread is recorded.
+      public:
+        Scope(Metrics &metrics, Operation operation)
+            : metrics(metrics), operation(operation),
+              outermost(COLLECT_METRICS && depth++ == 0) {
+            if (outermost) {
+                start = std::chrono::steady_clock::now();
+                comparisons_at_start = comparisons;
+            }
+        }
+
+        ~Scope() {
+            if (!COLLECT_METRICS) {
+                return;
+            }
+            depth--;
+            if (outermost) {
+                metrics.record(operation,
+                               std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count(),
+                               comparisons - comparisons_at_start);
+            }
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+      private:
+        Metrics &metrics;
+        Operation operation;
+        bool outermost;
+        std::chrono::steady_clock::time_point start;
+        uint64_t comparisons_at_start;
+    };
+
+    static void count_comparison() {
+        if (COLLECT_METRICS) {
+            comparisons++;
+        }
+    }
+
+    void print(std::ostream &out) const {
+        // A table of every operation that has been used. Percentiles are
+        // read off the histogram, so they're upper bounds within a factor of
+        // two.
+        static const char *const names[OPERATION_COUNT] = {
+            "Add", "Find", "Change", "Delete", "Phone",
+            "Fuzzy", "Range", "Rank", "Save", "Load"};
+        if (!COLLECT_METRICS) {
+            out << "Metrics are turned off (COLLECT_METRICS)" << std::endl;
+            return;
+        }
+        out << "Operation\tCalls\tMean us\tp50 us\tp99 us\tMax us\t"
+               "Compares/call"
+            << std::endl;
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(2);
+        for (size_t op = 0; op < OPERATION_COUNT; op++) {
+            const Counters &c = counters[op];
+            uint64_t calls = c.calls.load(std::memory_order_relaxed);
+            if (calls == 0) {
+                continue;
+            }
+            out << names[op] << "\t\t" << calls << "\t"
+                << c.nanoseconds.load(std::memory_order_relaxed) / 1e3 / calls
+                << "\t" << percentile(c, 0.5) / 1e3 << "\t"
+                << percentile(c, 0.99) / 1e3 << "\t"
+                << c.max_nanoseconds.load(std::memory_order_relaxed) / 1e3
+                << "\t"
+                << double(c.comparisons.load(std::memory_order_relaxed)) /
+                       calls
+                << std::endl;
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+  private:
+    // Bucket b counts operations that took [2^b, 2^(b+1)) nanoseconds.
+    static constexpr size_t HISTOGRAM_BUCKETS = 64;
+
+    struct Counters {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> nanoseconds;
+        std::atomic<uint64_t> max_nanoseconds;
+        std::atomic<uint64_t> comparisons;
+        std::atomic<uint64_t> histogram[HISTOGRAM_BUCKETS];
+    };
+
+    Counters counters[OPERATION_COUNT];
+
+    // Key comparisons made by this thread, and how deeply nested its scopes
+    // are.
+    static thread_local uint64_t comparisons;
+    static thread_local int depth;
+
+    void record(Operation operation, uint64_t nanoseconds,
+                uint64_t compared) {
+        Counters &c = counters[operation];
+        c.calls.fetch_add(1, std::memory_order_relaxed);
+        c.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        c.comparisons.fetch_add(compared, std::memory_order_relaxed);
+        c.histogram[63 - __builtin_clzll(nanoseconds | 1)].fetch_add(
+            1, std::memory_order_relaxed);
+        uint64_t max = c.max_nanoseconds.load(std::memory_order_relaxed);
+        while (nanoseconds > max &&
+               !c.max_nanoseconds.compare_exchange_weak(
+                   max, nanoseconds, std::memory_order_relaxed)) {
+        }
+    }
+
+    static uint64_t percentile(const Counters &c, double p) {
+        // The top of the bucket the p-th operation landed in, or the slowest
+        // operation if that's lower.
+        uint64_t calls = c.calls.load(std::memory_order_relaxed);
+        uint64_t max = c.max_nanoseconds.load(std::memory_order_relaxed);
+        uint64_t rank = uint64_t(p * (calls - 1)), seen = 0;
+        for (size_t b = 0; b + 1 < HISTOGRAM_BUCKETS; b++) {
+            seen += c.histogram[b].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                return std::min(uint64_t(2) << b, max);
+            }
+        }
+        return max;
+    }
+};
+
+thread_local uint64_t Metrics::comparisons = 0;
+thread_local int Metrics::depth = 0;
+
+class BPlus_Tree {
+    // Orders a book's nodes in a B+-tree instead of linking them into the
+    // AVL tree. Every tree node holds up to BPLUS_TREE_FANOUT keys, so a
+    // lookup reads a few wide nodes where the AVL tree chases a pointer per
+    // level, and the leaves are chained together so an in-order scan reads
+    // them front to back. The BST_Nodes themselves stay in the book's pool,
+    // so everything else holding one keeps working. Inner nodes count the
+    // entries under each child, which keeps finding the n-th entry O(log n).
+    // A node left under a quarter full by a delete is merged into a
+    // neighbour when the two fit in three quarters of a node; nothing is
+    // ever borrowed from a neighbour.
+  public:
+    struct Node {
+        bool leaf;
+        int size;
+        // Each key's prefix with the top bit flipped, so comparing them as
+        // signed integers orders them like the unsigned prefixes. Slots past
+        // size hold INT64_MAX, which no search counts as below its key, so
+        // searches can always compare the whole array.
+        int64_t prefixes[BPLUS_TREE_FANOUT];
+        // The next eight bytes of each key, zero padded like the prefix.
+        // Names sharing their first eight bytes usually differ here, which
+        // settles them without following a pointer to their text.
+        uint64_t suffixes[BPLUS_TREE_FANOUT];
+    };
+
+    struct Leaf : Node {
+        BST_Node *entries[BPLUS_TREE_FANOUT];
+        Leaf *previous;
+        Leaf *next;
+    };
+
+    struct Inner : Node {
+        // keys[i] is at or below every key under children[i], and above
+        // every key under the children before it. They're copies, since the
+        // entry one came from may be deleted; their text stays in the arena
+        // until the book is cleared. Searches treat keys[0] as below
+        // everything, and its prefix is INT64_MIN.
+        Person keys[BPLUS_TREE_FANOUT];
+        Node *children[BPLUS_TREE_FANOUT];
+        size_t counts[BPLUS_TREE_FANOUT];
+    };
+
+    BPlus_Tree() : root(nullptr), levels(0), leaves(0), inners(0) {}
+    ~BPlus_Tree() { clear(); }
+
+    BPlus_Tree(const BPlus_Tree &) = delete;
+    BPlus_Tree &operator=(const BPlus_Tree &) = delete;
+
+    BST_Node *find(const char *key, size_t length) const {
+        // The entry whose raw key is key, or nullptr.
+        int slot;
+        const Leaf *leaf = descend(Probe(key, length), slot, true);
+        if (leaf && slot < leaf->size &&
+            leaf->entries[slot]->person.compare_key(key, length) == 0) {
+            return leaf->entries[slot];
+        }
+        return nullptr;
+    }
+
+    bool insert(BST_Node *node) {
+        // Add node, unless an entry with the same name is already in. The
+        // node's key has to be in its final place, as a split may copy it.
+        const Person &p = node->person;
+        Probe probe(p.key, p.key_length());
+        if (!root) {
+            Leaf *leaf = make_leaf();
+            insert_entry(leaf, 0, node);
+            root = leaf;
+            levels = 1;
+            return true;
+        }
+        Inner *path[MAX_DEPTH];
+        int slots[MAX_DEPTH];
+        int depth = 0;
+        Node *at = root;
+        while (!at->leaf) {
+            Inner *inner = static_cast<Inner *>(at);
+            slots[depth] = child_slot(inner, probe);
+            path[depth] = inner;
+            at = inner->children[slots[depth++]];
+        }
+        Leaf *leaf = static_cast<Leaf *>(at);
+        int slot = leaf_slot(leaf, probe, true);
+        if (slot < leaf->size &&
+            leaf->entries[slot]->person.compare_key(p.key, p.key_length()) ==
+                0) {
+            return false;
+        }
+
+        // Every full node from the leaf up splits, and if they all do, a new
+        // root goes on top. Making the new nodes before anything changes
+        // means running out of memory leaves the tree as it was.
+        int splits = 0;
+        while (splits <= depth &&
+               (splits == 0 ? leaf->size : path[depth - splits]->size) ==
+                   BPLUS_TREE_FANOUT) {
+            splits++;
+        }
+        Leaf *new_leaf = nullptr;
+        Inner *new_inners[MAX_DEPTH + 1];
+        int inners_needed = splits == 0 ? 0 : splits - 1 + (splits > depth);
+        int made = 0;
+        try {
+            if (splits > 0) {
+                new_leaf = make_leaf();
+            }
+            for (; made < inners_needed; made++) {
+                new_inners[made] = make_inner();
+            }
+        } catch (...) {
+            if (new_leaf) {
+                free_node(new_leaf);
+            }
+            while (made > 0) {
+                free_node(new_inners[--made]);
+            }
+            throw;
+        }
+
+        for (int i = 0; i < depth; i++) {
+            path[i]->counts[slots[i]]++;
+        }
+        if (!new_leaf) {
+            insert_entry(leaf, slot, node);
+            return true;
+        }
+        // Move the top half of the leaf into the new one, then put the entry
+        // in whichever half it belongs to.
+        split(leaf, new_leaf);
+        if (slot <= leaf->size) {
+            insert_entry(leaf, slot, node);
+        } else {
+            insert_entry(new_leaf, slot - leaf->size, node);
+        }
+        Node *right = new_leaf;
+        Person key = new_leaf->entries[0]->person;
+        size_t right_count = new_leaf->size;
+        made = 0;
+        for (int level = depth - 1; level >= 0; level--) {
+            // Hand the new right half to the parent, splitting that too if
+            // it's full.
+            Inner *parent = path[level];
+            int child = slots[level] + 1;
+            parent->counts[child - 1] -= right_count;
+            if (parent->size < BPLUS_TREE_FANOUT) {
+                insert_child(parent, child, key, right, right_count);
+                return true;
+            }
+            Inner *sibling = new_inners[made++];
+            split(parent, sibling);
+            if (child <= parent->size) {
+                insert_child(parent, child, key, right, right_count);
+            } else {
+                insert_child(sibling, child - parent->size, key, right,
+                             right_count);
+            }
+            right = sibling;
+            key = sibling->keys[0];
+            right_count = weight(sibling);
+        }
+        // The root split, so the tree grows a level.
+        Inner *top = new_inners[made];
+        top->size = 1;
+        top->children[0] = root;
+        top->counts[0] = weight(root);
+        top->prefixes[0] = INT64_MIN;
+        insert_child(top, 1, key, right, right_count);
+        root = top;
+        levels++;
+        return true;
+    }
+
+    BST_Node *erase(const char *key, size_t length) {
+        // Take the entry whose raw key is key out of the tree and return it,
+        // or nullptr if there isn't one.
+        if (!root) {
+            return nullptr;
+        }
+        Probe probe(key, length);
+        Inner *path[MAX_DEPTH];
+        int slots[MAX_DEPTH];
+        int depth = 0;
+        Node *at = root;
+        while (!at->leaf) {
+            Inner *inner = static_cast<Inner *>(at);
+            slots[depth] = child_slot(inner, probe);
+            path[depth] = inner;
+            at = inner->children[slots[depth++]];
+        }
+        Leaf *leaf = static_cast<Leaf *>(at);
+        int slot = leaf_slot(leaf, probe, true);
+        if (slot == leaf->size ||
+            leaf->entries[slot]->person.compare_key(key, length) != 0) {
+            return nullptr;
+        }
+        BST_Node *node = leaf->entries[slot];
+        for (int i = 0; i < depth; i++) {
+            path[i]->counts[slots[i]]--;
+        }
+        std::memmove(leaf->entries + slot, leaf->entries + slot + 1,
+                     (leaf->size - slot - 1) * sizeof(BST_Node *));
+        remove_key(leaf, slot);
+
+        // Drop emptied nodes and merge nearly empty ones for as long as
+        // their parents keep losing children.
+        for (int level = depth - 1; level >= 0; level--) {
+            if (!shrink(path[level], slots[level])) {
+                break;
+            }
+        }
+        while (root && !root->leaf && root->size <= 1) {
+            // A root with one child hands the tree down to it.
+            Inner *top = static_cast<Inner *>(root);
+            root = top->size ? top->children[0] : nullptr;
+            free_node(top);
+            levels--;
+        }
+        if (root && root->size == 0) {
+            free_node(root);
+            root = nullptr;
+        }
+        if (!root) {
+            levels = 0;
+        }
+        return node;
+    }
+
+    void build(const std::vector<BST_Node *> &sorted) {
+        // Replace the tree with sorted, unique nodes packed into full leaves,
+        // and a level of full inner nodes at a time over them, in O(n).
+        clear();
+        if (sorted.empty()) {
+            return;
+        }
+        std::vector<Node *> level;
+        std::vector<size_t> counts;
+        std::vector<Person> lows;
+        Leaf *previous = nullptr;
+        for (size_t i = 0; i < sorted.size(); i += BPLUS_TREE_FANOUT) {
+            Leaf *leaf = make_leaf();
+            size_t n =
+                std::min<size_t>(BPLUS_TREE_FANOUT, sorted.size() - i);
+            for (size_t j = 0; j < n; j++) {
+                leaf->entries[j] = sorted[i + j];
+                set_key(leaf, j, sorted[i + j]->person);
+            }
+            leaf->size = n;
+            leaf->previous = previous;
+            if (previous) {
+                previous->next = leaf;
+            }
+            previous = leaf;
+            level.push_back(leaf);
+            counts.push_back(n);
+            lows.push_back(sorted[i]->person);
+        }
+        levels = 1;
+        while (level.size() > 1) {
+            std::vector<Node *> up;
+            std::vector<size_t> up_counts;
+            std::vector<Person> up_lows;
+            for (size_t i = 0; i < level.size(); i += BPLUS_TREE_FANOUT) {
+                Inner *inner = make_inner();
+                size_t n =
+                    std::min<size_t>(BPLUS_TREE_FANOUT, level.size() - i);
+                size_t total = 0;
+                for (size_t j = 0; j < n; j++) {
+                    inner->children[j] = level[i + j];
+                    inner->counts[j] = counts[i + j];
+                    inner->keys[j] = lows[i + j];
+                    set_key(inner, j, lows[i + j]);
+                    total += counts[i + j];
+                }
+                inner->size = n;
+                inner->prefixes[0] = INT64_MIN;
+                up.push_back(inner);
+                up_counts.push_back(total);
+                up_lows.push_back(lows[i]);
+            }
+            level.swap(up);
+            counts.swap(up_counts);
+            lows.swap(up_lows);
+            levels++;
+        }
+        root = level[0];
+    }
+
+    void clear() {
+        // Free every tree node. The entries belong to the book's pool.
+        std::vector<Node *> stack;
+        if (root) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            stack.pop_back();
+            if (!node->leaf) {
+                Inner *inner = static_cast<Inner *>(node);
+                stack.insert(stack.end(), inner->children,
+                             inner->children + inner->size);
+            }
+            free_node(node);
+        }
+        root = nullptr;
+        levels = 0;
+    }
+
+    const Leaf *lower_bound(const char *key, size_t length, bool inclusive,
+                            int &slot) const {
+        // The leaf and slot of the first entry at or after key (strictly
+        // after it unless inclusive), or nullptr past the last entry.
+        const Leaf *leaf = descend(Probe(key, length), slot, inclusive);
+        if (leaf && slot == leaf->size) {
+            leaf = leaf->next;
+            slot = 0;
+        }
+        return leaf;
+    }
+
+    BST_Node *select(size_t index) const {
+        // The entry with index entries before it, or nullptr.
+        const Node *at = root;
+        if (!at || index >= weight(at)) {
+            return nullptr;
+        }
+        while (!at->leaf) {
+            const Inner *inner = static_cast<const Inner *>(at);
+            int slot = 0;
+            while (index >= inner->counts[slot]) {
+                index -= inner->counts[slot++];
+            }
+            at = inner->children[slot];
+        }
+        return static_cast<const Leaf *>(at)->entries[index];
+    }
+
+    size_t count_below(const char *key, size_t length) const {
+        // Number of entries whose raw key sorts before key. Every child left
+        // of the one key falls in is wholly below it.
+        Probe probe(key, length);
+        size_t below = 0;
+        const Node *at = root;
+        if (!at) {
+            return 0;
+        }
+        while (!at->leaf) {
+            const Inner *inner = static_cast<const Inner *>(at);
+            int slot = child_slot(inner, probe);
+            for (int i = 0; i < slot; i++) {
+                below += inner->counts[i];
+            }
+            at = inner->children[slot];
+        }
+        return below + leaf_slot(static_cast<const Leaf *>(at), probe, true);
+    }
+
+    int height() const { return levels; }
+    size_t leaf_count() const { return leaves; }
+    size_t inner_count() const { return inners; }
+    size_t bytes() const {
+        return leaves * sizeof(Leaf) + inners * sizeof(Inner);
+    }
+
+  private:
+    // Deeper than any tree the fanout can reach with 64-bit counts.
+    static constexpr int MAX_DEPTH = 32;
+    static_assert(BPLUS_TREE_FANOUT % 2 == 0 && BPLUS_TREE_FANOUT >= 8,
+                  "BPLUS_TREE_FANOUT must be even and at least 8");
+
+    struct Probe {
+        // A key being searched for, with the words nodes keep of every key
+        // worked out once.
+        const char *key;
+        size_t length;
+        int64_t prefix;
+        uint64_t suffix;
+
+        Probe(const char *key, size_t length)
+            : key(key), length(length),
+              prefix(biased(Person::make_prefix(key, length))),
+              suffix(suffix_of(key, length)) {}
+    };
+
+    Node *root;
+    int levels;
+    size_t leaves, inners;
+
+    static int64_t biased(uint64_t prefix) {
+        return int64_t(prefix ^ (uint64_t(1) << 63));
+    }
+
+    static uint64_t suffix_of(const char *key, size_t length) {
+        return length > 8 ? Person::make_prefix(key + 8, length - 8) : 0;
+    }
+
+    static void set_key(Node *node, int slot, const Person &p) {
+        node->prefixes[slot] = biased(p.key_prefix);
+        node->suffixes[slot] = suffix_of(p.key, p.key_length());
+    }
+
+    static int compare_at(const Node *node, int slot, const Person &p,
+                          const Probe &probe) {
+        // Compare the key at slot, which shares probe's prefix, with probe.
+        // The text is only read when the suffixes tie too.
+        if (node->suffixes[slot] != probe.suffix) {
+            return node->suffixes[slot] > probe.suffix ? 1 : -1;
+        }
+        Metrics::count_comparison();
+        return p.compare_key(probe.key, probe.length);
+    }
+
+    static int count_below(const int64_t *prefixes, int64_t target) {
+        // Number of prefixes below target, which in a sorted node is also
+        // the first slot that isn't. The whole array is compared without
+        // branching, two at a time where SSE4.2 is available.
+        int below = 0;
+#if defined(__SSE4_2__)
+        __m128i wanted = _mm_set1_epi64x(target);
+        for (int i = 0; i < BPLUS_TREE_FANOUT; i += 2) {
+            __m128i pair = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(prefixes + i));
+            below += __builtin_popcount(_mm_movemask_pd(
+                _mm_castsi128_pd(_mm_cmpgt_epi64(wanted, pair))));
+        }
+#else
+        for (int i = 0; i < BPLUS_TREE_FANOUT; i++) {
+            below += prefixes[i] < target;
+        }
+#endif
+        return below;
+    }
+
+    static int prefix_run_end(const Node *node, int64_t prefix) {
+        // One past the last slot whose prefix is prefix or below.
+        if (prefix == INT64_MAX) {
+            return node->size;
+        }
+        return std::min(count_below(node->prefixes, prefix + 1), node->size);
+    }
+
+    static int leaf_slot(const Leaf *leaf, const Probe &probe,
+                         bool inclusive) {
+        // The first slot whose entry is at or after the probe (strictly
+        // after it unless inclusive). Only the entries sharing its prefix
+        // need comparing any further, and a binary search keeps that cheap
+        // when many do.
+        int low = count_below(leaf->prefixes, probe.prefix);
+        int high = prefix_run_end(leaf, probe.prefix);
+        while (low < high) {
+            int middle = (low + high) / 2;
+            int direction =
+                compare_at(leaf, middle, leaf->entries[middle]->person, probe);
+            if (direction > 0 || (direction == 0 && inclusive)) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return low;
+    }
+
+    static int child_slot(const Inner *inner, const Probe &probe) {
+        // The child the probe falls under: the last one whose key is at or
+        // below it.
+        int low = std::max(count_below(inner->prefixes, probe.prefix), 1);
+        int high = std::max(prefix_run_end(inner, probe.prefix), low);
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (compare_at(inner, middle, inner->keys[middle], probe) > 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return low - 1;
+    }
+
+    const Leaf *descend(const Probe &probe, int &slot, bool inclusive) const {
+        // The leaf the probe belongs in and the slot it has or would have
+        // there.
+        if (!root) {
+            return nullptr;
+        }
+        const Node *at = root;
+        while (!at->leaf) {
+            const Inner *inner = static_cast<const Inner *>(at);
+            at = inner->children[child_slot(inner, probe)];
+        }
+        const Leaf *leaf = static_cast<const Leaf *>(at);
+        slot = leaf_slot(leaf, probe, inclusive);
+        return leaf;
+    }
+
+    static size_t weight(const Node *node) {
+        // Entries under node.
+        if (node->leaf) {
+            return node->size;
+        }
+        const Inner *inner = static_cast<const Inner *>(node);
+        size_t total = 0;
+        for (int i = 0; i < inner->size; i++) {
+            total += inner->counts[i];
+        }
+        return total;
+    }
+
+    Leaf *make_leaf() {
+        Leaf *leaf = new Leaf;
+        leaf->leaf = true;
+        leaf->size = 0;
+        std::fill(leaf->prefixes, leaf->prefixes + BPLUS_TREE_FANOUT,
+                  INT64_MAX);
+        leaf->previous = leaf->next = nullptr;
+        leaves++;
+        return leaf;
+    }
+
+    Inner *make_inner() {
+        Inner *inner = new Inner;
+        inner->leaf = false;
+        inner->size = 0;
+        std::fill(inner->prefixes, inner->prefixes + BPLUS_TREE_FANOUT,
+                  INT64_MAX);
+        inners++;
+        return inner;
+    }
+
+    void free_node(Node *node) {
+        if (node->leaf) {
+            leaves--;
+            delete static_cast<Leaf *>(node);
+        } else {
+            inners--;
+            delete static_cast<Inner *>(node);
+        }
+    }
+
+    static void insert_entry(Leaf *leaf, int slot, BST_Node *node) {
+        // The caller makes sure there's room.
+        int after = leaf->size - slot;
+        std::memmove(leaf->entries + slot + 1, leaf->entries + slot,
+                     after * sizeof(BST_Node *));
+        std::memmove(leaf->prefixes + slot + 1, leaf->prefixes + slot,
+                     after * sizeof(int64_t));
+        std::memmove(leaf->suffixes + slot + 1, leaf->suffixes + slot,
+                     after * sizeof(uint64_t));
+        leaf->entries[slot] = node;
+        set_key(leaf, slot, node->person);
+        leaf->size++;
+    }
+
+    static void insert_child(Inner *inner, int slot, const Person &key,
+                             Node *child, size_t count) {
+        // Put child at slot, which is never 0. The caller makes sure there's
+        // room.
+        for (int i = inner->size; i > slot; i--) {
+            inner->keys[i] = inner->keys[i - 1];
+            inner->children[i] = inner->children[i - 1];
+            inner->counts[i] = inner->counts[i - 1];
+            inner->prefixes[i] = inner->prefixes[i - 1];
+            inner->suffixes[i] = inner->suffixes[i - 1];
+        }
+        inner->keys[slot] = key;
+        inner->children[slot] = child;
+        inner->counts[slot] = count;
+        set_key(inner, slot, key);
+        inner->size++;
+    }
+
+    static void remove_key(Node *node, int slot) {
+        // Close the gap slot leaves in the key words and shrink node by one.
+        int after = node->size - slot - 1;
+        std::memmove(node->prefixes + slot, node->prefixes + slot + 1,
+                     after * sizeof(int64_t));
+        std::memmove(node->suffixes + slot, node->suffixes + slot + 1,
+                     after * sizeof(uint64_t));
+        node->prefixes[--node->size] = INT64_MAX;
+    }
+
+    static void split(Leaf *leaf, Leaf *right) {
+        // Move the top half of a full leaf into the empty leaf right, which
+        // goes after it in the chain.
+        int half = BPLUS_TREE_FANOUT / 2;
+        for (int i = half; i < BPLUS_TREE_FANOUT; i++) {
+            right->entries[i - half] = leaf->entries[i];
+            right->prefixes[i - half] = leaf->prefixes[i];
+            right->suffixes[i - half] = leaf->suffixes[i];
+            leaf->prefixes[i] = INT64_MAX;
+        }
+        right->size = BPLUS_TREE_FANOUT - half;
+        leaf->size = half;
+        right->next = leaf->next;
+        right->previous = leaf;
+        if (leaf->next) {
+            leaf->next->previous = right;
+        }
+        leaf->next = right;
+    }
+
+    static void split(Inner *inner, Inner *right) {
+        // Move the top half of a full inner node into the empty node right.
+        // Its first key becomes the one its parent knows it by.
+        int half = BPLUS_TREE_FANOUT / 2;
+        for (int i = half; i < BPLUS_TREE_FANOUT; i++) {
+            right->keys[i - half] = inner->keys[i];
+            right->children[i - half] = inner->children[i];
+            right->counts[i - half] = inner->counts[i];
+            right->prefixes[i - half] = inner->prefixes[i];
+            right->suffixes[i - half] = inner->suffixes[i];
+            inner->prefixes[i] = INT64_MAX;
+        }
+        right->prefixes[0] = INT64_MIN;
+        right->size = BPLUS_TREE_FANOUT - half;
+        inner->size = half;
+    }
+
+    bool shrink(Inner *parent, int slot) {
+        // Tidy up after the child at slot lost an entry or a child: drop it
+        // if it's empty, or merge it with a neighbour if it's nearly empty
+        // and they fit together. Returns whether parent lost a child.
+        Node *child = parent->children[slot];
+        if (child->size == 0) {
+            if (child->leaf) {
+                Leaf *leaf = static_cast<Leaf *>(child);
+                if (leaf->previous) {
+                    leaf->previous->next = leaf->next;
+                }
+                if (leaf->next) {
+                    leaf->next->previous = leaf->previous;
+                }
+            }
+            free_node(child);
+            remove_child(parent, slot);
+            return true;
+        }
+        if (child->size >= BPLUS_TREE_FANOUT / 4 || parent->size < 2) {
+            return false;
+        }
+        // Merge the right one of the pair into the left one.
+        int right_slot = slot + 1 < parent->size ? slot + 1 : slot;
+        Node *left = parent->children[right_slot - 1];
+        Node *right = parent->children[right_slot];
+        if (left->size + right->size > BPLUS_TREE_FANOUT * 3 / 4) {
+            return false;
+        }
+        if (left->leaf) {
+            Leaf *to = static_cast<Leaf *>(left);
+            Leaf *from = static_cast<Leaf *>(right);
+            for (int i = 0; i < from->size; i++) {
+                to->entries[to->size + i] = from->entries[i];
+                to->prefixes[to->size + i] = from->prefixes[i];
+                to->suffixes[to->size + i] = from->suffixes[i];
+            }
+            to->next = from->next;
+            if (from->next) {
+                from->next->previous = to;
+            }
+        } else {
+            // The parent's key for right takes the place of right's first
+            // key, which searches never look at.
+            Inner *to = static_cast<Inner *>(left);
+            Inner *from = static_cast<Inner *>(right);
+            for (int i = 0; i < from->size; i++) {
+                const Person &key =
+                    i ? from->keys[i] : parent->keys[right_slot];
+                to->keys[to->size + i] = key;
+                to->children[to->size + i] = from->children[i];
+                to->counts[to->size + i] = from->counts[i];
+                set_key(to, to->size + i, key);
+            }
+        }
+        left->size += right->size;
+        parent->counts[right_slot - 1] += parent->counts[right_slot];
+        free_node(right);
+        remove_child(parent, right_slot);
+        return true;
+    }
+
+    static void remove_child(Inner *inner, int slot) {
+        for (int i = slot; i + 1 < inner->size; i++) {
+            inner->keys[i] = inner->keys[i + 1];
+            inner->children[i] = inner->children[i + 1];
+            inner->counts[i] = inner->counts[i + 1];
+        }
+        remove_key(inner, slot);
+        if (slot == 0 && inner->size > 0) {
+            inner->prefixes[0] = INT64_MIN;
+        }
+    }
+};
+
+class Book {
+  public:
+    class Cursor {
+        // Streams entries in alphabetical order, one per call to next(),
+        // from a lower bound up to an upper bound or for as long as they
+        // match a prefix. Only the path down to the first entry is visited up
+        // front, so reading k entries costs O(log n + k) and stopping early
+        // costs nothing more. A cursor is only valid until the book is next
+        // changed, so in a thread-safe book don't use one while other threads
+        // are writing.
+      public:
+        bool next(Person &result) {
+            // Copy out the next entry, or return false once past the end.
+            if (done) {
+                return false;
+            }
+            Person p;
+            if (snapshot) {
+                if (index >= snapshot->size()) {
+                    done = true;
+                    return false;
+                }
+                p = snapshot->person(index++);
+            } else if (in_leaves) {
+                if (!leaf) {
+                    done = true;
+                    return false;
+                }
+                p = leaf->entries[slot]->person;
+                if (++slot == leaf->size) {
+                    leaf = leaf->next;
+                    slot = 0;
+                }
+            } else {
+                BST_Node *node = nodes.next();
+                if (!node) {
+                    done = true;
+                    return false;
+                }
+                p = node->person;
+            }
+            if (!within_bound(p)) {
+                done = true;
+                return false;
+            }
+            result = p;
+            return true;
+        }
+
+      private:
+        friend class Book;
+        enum Bound { UNBOUNDED, PREFIX, UP_TO };
+
+        BST_Cursor nodes;
+        // Set instead of nodes when the book is still an attached snapshot.
+        const Snapshot *snapshot;
+        size_t index;
+        // Used instead of nodes when the book keeps a B+-tree: the next
+        // entry's leaf (nullptr once past the last) and slot.
+        bool in_leaves;
+        const BPlus_Tree::Leaf *leaf;
+        int slot;
+        Bound bound;
+        // Raw key bytes of the prefix or the last key in range.
+        std::string bound_key;
+        bool done;
+
+        Cursor(const Book &book, const std::string &from, bool inclusive,
+               Bound bound, const std::string &bound_key)
+            : nodes(nullptr, BST_Cursor::INORDER), snapshot(nullptr), index(0),
+              in_leaves(false), leaf(nullptr), slot(0), bound(bound),
+              bound_key(bound_key), done(false) {
+            if (book.snapshot.is_open()) {
+                snapshot = &book.snapshot;
+                index = snapshot->lower_bound(from.data(), from.length(),
+                                              inclusive);
+            } else if (book.use_bplus_tree) {
+                in_leaves = true;
+                leaf = book.bplus_tree.lower_bound(from.data(), from.length(),
+                                                   inclusive, slot);
+            } else {
+                nodes = BST_Cursor(book.head, from.data(), from.length(),
+                                   inclusive);
+            }
+        }
+
+        bool within_bound(const Person &p) const {
+            if (bound == PREFIX) {
+                return p.has_prefix(bound_key.data(), bound_key.length());
+            } else if (bound == UP_TO) {
+                return p.compare_key(bound_key.data(), bound_key.length()) <= 0;
+            }
+            return true;
+        }
+    };
+
+    class Transaction {
+        // Changes collected to be made to a book as a unit by Book::apply.
+        // Nothing happens to the book until then.
+      public:
+        void add(const std::string &first, const std::string &last,
+                 const std::string &phone_number) {
+            changes.push_back(Change{'A', first, last, phone_number});
+        }
+
+        void change(const std::string &first, const std::string &last,
+                    const std::string &phone_number) {
+            changes.push_back(Change{'C', first, last, phone_number});
+        }
+
+        void remove(const std::string &first, const std::string &last) {
+            changes.push_back(Change{'D', first, last, ""});
+        }
+
+        size_t size() const { return changes.size(); }
+        void clear() { changes.clear(); }
+
+      private:
+        friend class Book;
+
+        struct Change {
+            // Same op letters and fields as a journal record.
+            char op;
+            std::string first, last, phone_number;
+        };
+        std::vector<Change> changes;
+    };
+
+    class Version {
+        // The book as it was when freeze() was called. Changes made to the
+        // book afterwards don't show up, and nothing in a version ever
+        // changes, so it can be searched, scanned, saved or exported on any
+        // thread without the book's lock while updates carry on. Copies are
+        // cheap and share everything.
+      public:
+        class Cursor {
+            // Every entry of a version in alphabetical order, one per call to
+            // next(). Valid for as long as the version it came from.
+          public:
+            bool next(Person &result) {
+                const Version_Node *node = nodes.next();
+                if (!node) {
+                    return false;
+                }
+                result = node->person;
+                return true;
+            }
+
+          private:
+            friend class Version;
+            Tree_Cursor<const Version_Node> nodes;
+
+            explicit Cursor(const Version_Node *root)
+                : nodes(root, Tree_Cursor<const Version_Node>::INORDER) {}
+        };
+
+        Version() : root(nullptr), entries(0) {}
+        Version(const Version &other)
+            : root(Version_Tree::retain(other.root)), arena(other.arena),
+              entries(other.entries) {}
+        ~Version() { Version_Tree::release(root); }
+
+        Version &operator=(const Version &other) {
+            const Version_Node *old = root;
+            root = Version_Tree::retain(other.root);
+            Version_Tree::release(old);
+            arena = other.arena;
+            entries = other.entries;
+            return *this;
+        }
+
+        size_t size() const { return entries; }
+
+        Cursor scan() const { return Cursor(root); }
+
+        bool find(std::string first, std::string last, Person &result) const {
+            std::transform(first.begin(), first.end(), first.begin(),
+                           ::toupper);
+            std::transform(last.begin(), last.end(), last.begin(), ::toupper);
+            std::string key = last + '\0' + first;
+            const Version_Node *node = root;
+            while (node) {
+                int direction =
+                    node->person.compare_key(key.data(), key.length());
+                if (direction == 0) {
+                    result = node->person;
+                    return true;
+                }
+                node = direction > 0 ? node->left : node->right;
+            }
+            return false;
+        }
+
+        bool write_text(const char *path) const {
+            // Write a save file, in pre order like Book::save.
+            std::vector<const Person *> people;
+            Tree_Cursor<const Version_Node> cursor(
+                root, Tree_Cursor<const Version_Node>::PREORDER);
+            while (const Version_Node *node = cursor.next()) {
+                people.push_back(&node->person);
+            }
+            return write_save_file(path, people);
+        }
+
+        bool write_snapshot(const char *path) const {
+            std::vector<const Person *> people;
+            Tree_Cursor<const Version_Node> cursor(
+                root, Tree_Cursor<const Version_Node>::INORDER);
+            while (const Version_Node *node = cursor.next()) {
+                people.push_back(&node->person);
+            }
+            return write_snapshot_file(path, people);
+        }
+
+        bool export_table(const char *path) const {
+            // Write the table display_book prints to a file.
+            std::ofstream File(path, std::ios::binary | std::ios::trunc);
+            if (!File.good()) {
+                return false;
+            }
+            Cursor cursor = scan();
+            write_table(File, entries,
+                        [&cursor](Person &p) { return cursor.next(p); });
+            File.close();
+            return !File.fail();
+        }
+
+      private:
+        friend class Book;
+        const Version_Node *root;
+        // Where the entries' text lives. Held so clearing the book can't
+        // pull it out from under the version.
+        std::shared_ptr<String_Arena> arena;
+        size_t entries;
+    };
+
+    Book() : Book(BALANCED_TREE) {}
+    Book(bool balanced) : Book(balanced, THREAD_SAFE_BOOK) {}
+    Book(bool balanced, bool thread_safe)
+        : Book(balanced, thread_safe, BPLUS_TREE_BOOK) {}
+    // A book kept in a B+-tree is always balanced, whatever balanced says.
+    Book(bool balanced, bool thread_safe, bool bplus_tree)
+        : lock(thread_safe), head(nullptr), count(0), replaying(false),
+          transaction_log(nullptr), quiet(false), balanced(balanced),
+          use_bplus_tree(bplus_tree), arena(std::make_shared<String_Arena>()),
+          save_file(SAVE_FILE_NAME), snapshot_file(SNAPSHOT_FILE_NAME),
+          journal_file(JOURNAL_FILE_NAME) {}
+    ~Book() { reset(); }
+
+    bool add_entry(std::string first, std::string last,
+                   std::string phone_number) {
+        Metrics::Scope scope(metrics, Metrics::ADD);
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        // Convert the names and lay the record out in a scratch buffer.
+        first_last_to_upper(first, last);
+        if (first.length() > UINT16_MAX || last.length() > UINT16_MAX) {
+            if (!quiet) {
+                std::cout << "\nName is too long\n" << std::endl;
+            }
+            return false;
+        }
+        std::string buffer;
+        Person p = Person::pack(first, last, phone_number, buffer);
+        // The text goes into the arena before the node is linked in, so
+        // copying it can't fail and leave a node in the tree without its
+        // text, and a B+-tree split can copy the key.
+        p.key = arena->store(buffer);
+        // Create a new node from the pool.
+        BST_Node *new_node = pool.acquire(p);
+
+        bool inserted = true;
+        if (use_bplus_tree) {
+            inserted = bplus_insertion(new_node);
+        } else if (is_empty()) {
+            // If empty, make the new node the new head.
+            this->head = new_node;
+            count++;
+        } else {
+            inserted = this->insertion(head, new_node) != nullptr;
+        }
+        if (!inserted) {
+            // A rejected node goes straight back to the pool, and its text
+            // back to the arena.
+            pool.release(new_node);
+            arena->unstore(buffer.length());
+            return false;
+        }
+
+        index_phone(new_node);
+        trigrams.add(new_node);
+        versions.insert(new_node->person);
+        log_change('A', first, last, phone_number);
+        return true;
+    }
+
+    void display_book() {
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        // Perform an inorder traversal on the tree.
+        if (is_empty()) {
+            std::cout << "\nNo records\n" << std::endl;
+            return;
+        }
+        write_table(std::cout);
+        std::cout << std::endl;
+    }
+
+    bool export_book(const char *path) {
+        // Write the same table display_book prints to a file.
+        if (SAVE_FROM_VERSION && lock.is_enabled()) {
+            return freeze().export_table(path);
+        }
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        std::ofstream File(path, std::ios::binary | std::ios::trunc);
+        if (!File.good()) {
+            return false;
+        }
+        write_table(File);
+        File.close();
+        return !File.fail();
+    }
+
+    bool export_compressed(const char *path) {
+        // Write the book in name order as a Compressed_File.
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        std::vector<BST_Node *> nodes;
+        sorted_nodes(nodes);
+        std::vector<const Person *> people(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            people[i] = &nodes[i]->person;
+        }
+        return Compressed_File::write(path, people, COMPRESSED_BLOCK_ENTRIES);
+    }
+
+    bool import_compressed(const char *path) {
+        // Replace the book with one written by export_compressed(). The names
+        // come out sorted, so the tree is built straight from them as from a
+        // snapshot. A damaged file is refused before the book is touched.
+        Metrics::Scope scope(metrics, Metrics::LOAD);
+        // Taken before the book's lock, as save_version() does, so a save
+        // already under way is waited for rather than skipped below.
+        std::lock_guard<std::mutex> save_guard(saving);
+        Book_Lock::Guard guard(lock, true);
+        Compressed_File file;
+        if (!file.open(path)) {
+            return false;
+        }
+        for (size_t i = 0; i < file.block_count(); i++) {
+            if (!file.verify_block(i)) {
+                return false;
+            }
+        }
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        reset();
+        std::vector<BST_Node *> nodes;
+        nodes.reserve(file.size());
+        std::string buffer, previous;
+        bool valid = true;
+        for (size_t i = 0; i < file.block_count() && valid; i++) {
+            // Each block checks its own names are in order, and its first
+            // one is checked against the last of the block before.
+            Compressed_File::Reader reader = file.block(i);
+            size_t first = nodes.size();
+            Person p;
+            while (valid && reader.next()) {
+                valid = reader.person(buffer, p) &&
+                        (nodes.size() > first || first == 0 ||
+                         Person::compare_text(previous.data(), previous.size(),
+                                              reader.key.data(),
+                                              reader.key.size()) < 0);
+                if (valid) {
+                    p.key = arena->store(buffer);
+                    nodes.push_back(pool.acquire(p));
+                }
+            }
+            valid = valid && !reader.failed();
+            previous.swap(reader.key);
+        }
+        if (!valid || nodes.size() != file.size()) {
+            std::cout << path << " is malformed, starting with an empty "
+                      << "phonebook" << std::endl;
+            reset();
+            return false;
+        }
+        build_balanced(nodes);
+        report_throughput("Imported", start);
+        // The journal can't replay an import, so it goes straight into the
+        // save files instead. If they can't be written, a restart would
+        // bring back the old book.
+        if (journal.is_open() && !rewrite_save()) {
+            std::cout << "Could not save the imported phonebook to "
+                      << save_file << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static size_t display_page(Cursor &cursor, size_t rows, size_t number) {
+        // Print up to rows entries from cursor as one write, numbering them
+        // from number. Returns how many were printed.
+        std::string page;
+        Person entry;
+        size_t printed = 0;
+        while (printed < rows && cursor.next(entry)) {
+            page += std::to_string(number + printed++);
+            page += '\t';
+            entry.display_person(page);
+        }
+        std::cout << page;
+        return printed;
+    }
+
+    bool find_person(const std::string &first, const std::string &last,
+                     Person &result) {
+        // Look up an entry and copy out its Person. Unlike find_entry this
+        // can be answered straight from an attached snapshot, so it doesn't
+        // force the tree to be built. The result's text stays valid until the
+        // book is next cleared or loaded, except while a save file is still
+        // loading, when it's only good until this thread's next lookup. This
+        // is the lookup to use from several threads at once.
+        static thread_local std::string text;
+        return find_person(first, last, result, text);
+    }
+
+    bool find_person(std::string first, std::string last, Person &result,
+                     std::string &text) {
+        // As above, but a result read out of a save file that is still
+        // loading views its text in the caller's text, which has to outlive
+        // it. Nothing is added to the arena, which readers never change.
+        Metrics::Scope scope(metrics, Metrics::FIND);
+        Book_Lock::Guard guard(lock, false);
+        first_last_to_upper(first, last);
+        std::string buffer;
+        Person p = Person::pack(first, last, "", buffer);
+        if (snapshot.is_open()) {
+            return snapshot.find(p, result);
+        }
+        if (save_index.is_open()) {
+            return save_index.find(first, last, text, result);
+        }
+        BST_Node *entry = find_node(p);
+        if (!entry) {
+            return false;
+        }
+        result = entry->person;
+        return true;
+    }
+
+    BST_Node *find_entry(std::string first, std::string last) {
+        // In a thread-safe book the node may be changed or deleted by another
+        // thread as soon as this returns; use find_person there instead.
+        Metrics::Scope scope(metrics, Metrics::FIND);
+        // Convert first and last name to uppercase.
+        first_last_to_upper(first, last);
+        // Run locate node search.
+        std::string buffer;
+        Person p = Person::pack(first, last, "", buffer);
+        settle();
+        while (true) {
+            {
+                Book_Lock::Guard guard(lock, false);
+                if (!snapshot.is_open()) {
+                    return find_node(p);
+                }
+            }
+            // Only building the tree needs the exclusive lock.
+            Book_Lock::Guard guard(lock, true);
+            materialize();
+        }
+    }
+
+    Person *change_entry(std::string first, std::string last,
+                         std::string phone_number) {
+        Metrics::Scope scope(metrics, Metrics::CHANGE);
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        // Convert first and last to uppercase.
+        first_last_to_upper(first, last);
+
+        // Locate the node.
+        BST_Node *entry = find_entry(first, last);
+
+        if (!entry) {
+            if (!quiet) {
+                std::cout << "\nCould not locate entry\n" << std::endl;
+            }
+            return nullptr;
+        }
+
+        if (phone_number.length() <= 0) {
+            if (!quiet) {
+                std::cout << "\nPhone number cannot be blank\n" << std::endl;
+            }
+            return nullptr;
+        }
+
+        unindex_phone(entry);
+        uint64_t digits = Person::pack_phone(phone_number);
+        if (!digits) {
+            // Numbers that can't be packed are stored as text after the names,
+            // so the record is rewritten into the arena.
+            std::string buffer;
+            Person::pack(entry->person.first(), entry->person.last(),
+                         phone_number, buffer);
+            entry->person.key = arena->store(buffer);
+        }
+        entry->person.phone_digits = digits;
+        index_phone(entry);
+        versions.insert(entry->person);
+        log_change('C', first, last, phone_number);
+        return &entry->person;
+    }
+
+    bool delete_entry(std::string first, std::string last) {
+        /***
+         * I did deletion a little weird here. I wanted a certain node's memory
+         * address to always point to the same value throughout that node's
+         * entire lifetime. When deleting an node with both a left and right
+         * child, normally we perform a value swapping operation with the node
+         * and its in order successor. However, this could lead to unexpected
+         * behavior. Say you have a pointer to Node B. Node B happens to be the
+         * in order successor to Node A. Their values get swapped and then Node
+         * B gets deleted. From your pointer variable's perspective this was
+         * unexpected behavior and now your pointer is broken. In order to fix
+         * this, I do deletion without any swapping. This means that the
+         * pointers are maintained throughout a node's life.
+         */
+
+        Metrics::Scope scope(metrics, Metrics::DELETE);
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        // Convert to uppercase.
+        first_last_to_upper(first, last);
+        std::string buffer;
+        Person p = Person::pack(first, last, "", buffer);
+
+        if (use_bplus_tree) {
+            // The B+-tree relinks itself, so there's only the entry to let
+            // go of.
+            BST_Node *entry = bplus_tree.erase(p.key, p.key_length());
+            if (!entry) {
+                return false;
+            }
+            unindex_phone(entry);
+            trigrams.remove(entry);
+            versions.remove(entry->person);
+            pool.release(entry);
+            count--;
+            log_change('D', first, last, "");
+            return true;
+        }
+
+        int direction =
+            0; // -1 Means the node to delete is on the left, 0 means it's equal
+               // to the parent, and 1 means it's on the right.
+
+        // Locate the parent of the node we wish to delete
+        BST_Node *parent = locate_node(head, &p, true);
+
+        // locate_node should never return nullptr in this case. So, end here
+        // if the value to delete doesn't exist. locate_node will return
+        // the value itself if it has no parent (ie. it's the root node).
+        if (!parent)
+            return false;
+
+        // A pointer to keep track of the actual node to delete.
+        BST_Node *entry;
+
+        // We set the node depending on whether or not it's the left or right
+        // child of the parent.
+        if (parent->left && compare_names(parent->left->person, p) == 0) {
+            direction = -1;
+            entry = parent->left;
+        } else if (parent->right &&
+                   compare_names(parent->right->person, p) == 0) {
+            direction = 1;
+            entry = parent->right;
+        } else {
+            // This means that we're dealing with the root node as the parent is
+            // equal to the node to delete.
+            entry = parent;
+        }
+        unindex_phone(entry);
+        trigrams.remove(entry);
+        versions.remove(entry->person);
+
+        // The parent the entry's replacement should hang off of. The root has
+        // no parent.
+        BST_Node *new_parent = direction == 0 ? nullptr : parent;
+        // The lowest node whose subtree changed shape. Heights are fixed (and
+        // the tree rebalanced) from here back up to the root.
+        BST_Node *retrace_from = new_parent;
+
+        // This set of if statements determines how many children the node has.
+        if (entry->left && entry->right) {
+            // The node has both its children.
+            // We need to find the minimum element of the right subtree.
+            BST_Node *next_element = entry->right;
+            BST_Node *next_element_parent =
+                entry; // Keep track of the next element's parent as well.
+
+            // Recurse down the left side of the node's right subtree.
+            while (next_element && next_element->left) {
+                next_element_parent = next_element;
+                next_element = next_element->left;
+            }
+
+            // If the node is the right subchild of its parent
+            if (direction == 1) {
+                // Move the parent's right pointer to the node's next greatest
+                // element.
+                parent->right = next_element;
+            } else if (direction == -1) {
+                // Do the opposite of the above.
+                parent->left = next_element;
+            } else {
+                // If direction == 0, then we need to set head to be the next
+                // element.
+                head = next_element;
+            }
+            next_element->parent = new_parent;
+
+            if (next_element != entry->right) {
+                // If the next element isn't the node's direct child, then we
+                // need to reposition its parent to point to the next value
+                // beyond the in order successor.
+                next_element_parent->left = next_element->right;
+                if (next_element->right) {
+                    next_element->right->parent = next_element_parent;
+                }
+                // We also need to move the right pointer of the right child of
+                // the deleted node.
+                next_element->right = entry->right;
+                entry->right->parent = next_element;
+                retrace_from = next_element_parent;
+            } else {
+                retrace_from = next_element;
+            }
+
+            // The replacement node's left child should match the deleted node's
+            // left child.
+            next_element->left = entry->left;
+            entry->left->parent = next_element;
+            // Deallocate the deleted node.
+            pool.release(entry);
+            // Decrement the counter.
+            count--;
+        } else if (entry->left) {
+            // Node only has left child. Depending on the direction, jump over
+            // the node to be deleted.
+            if (direction == -1) {
+                parent->left = entry->left;
+            } else if (direction == 1) {
+                parent->right = entry->left;
+            } else {
+                head = entry->left;
+            }
+            entry->left->parent = new_parent;
+
+            // Deallocate the deleted node.
+            pool.release(entry);
+            count--;
+        } else if (entry->right) {
+            // Same process as above, just the opposite side.
+            if (direction == -1) {
+                parent->left = entry->right;
+            } else if (direction == 1) {
+                parent->right = entry->right;
+            } else {
+                head = entry->right;
+            }
+            entry->right->parent = new_parent;
+            pool.release(entry);
+            count--;
+        } else {
+            // Node is a leaf node. Set it to nullptr and update its parent.
+            pool.release(entry);
             count--;
             entry = nullptr;
             if (direction == 1) {
@@ -278,213 +3932,2590 @@ class Book {
             } else if (direction == -1) {
                 parent->left = nullptr;
             } else {
-                head = nullptr;
+                head = nullptr;
+            }
+        }
+
+        // Rotations only relink nodes, so every surviving node keeps its
+        // address.
+        retrace(retrace_from);
+        log_change('D', first, last, "");
+        return true;
+    }
+
+    bool save() {
+        Metrics::Scope scope(metrics, Metrics::SAVE);
+        if (SAVE_FROM_VERSION && lock.is_enabled()) {
+            return save_version();
+        }
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        // Nothing to save.
+        if (is_empty()) {
+            return false;
+        }
+        return compact();
+    }
+
+    Version freeze() {
+        // The book as it is right now, as a version that later changes won't
+        // touch. The first call copies the tree in O(n); from then on the
+        // copy is kept up to date, and freezing it costs O(1).
+        {
+            Book_Lock::Guard guard(lock, false);
+            if (versions.is_built()) {
+                return current_version();
+            }
+        }
+        // Building the copy (and the tree under it) needs the exclusive
+        // lock.
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        if (!versions.is_built()) {
+            std::vector<BST_Node *> nodes;
+            sorted_nodes(nodes);
+            versions.build(nodes);
+        }
+        return current_version();
+    }
+
+    bool sync() {
+        // Make sure every change so far is on disk.
+        Book_Lock::Guard guard(lock, true);
+        return journal.sync();
+    }
+
+    void set_file_names(const std::string &stem) {
+        // Keep the book in stem.txt, stem.snap and stem.journal rather than
+        // the default files, so several books can share a directory. Call
+        // before load() or open_journal().
+        Book_Lock::Guard guard(lock, true);
+        save_file = stem + ".txt";
+        snapshot_file = stem + ".snap";
+        journal_file = stem + ".journal";
+    }
+
+    bool open_journal() {
+        // Start journaling changes. Call before load() so the changes logged
+        // by earlier sessions get replayed.
+        Book_Lock::Guard guard(lock, true);
+        return journal.open(journal_file.c_str());
+    }
+
+    bool save_snapshot() {
+        // Write the book in sorted order as a binary snapshot.
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        if (is_empty()) {
+            return false;
+        }
+        std::vector<BST_Node *> nodes;
+        sorted_nodes(nodes);
+        std::vector<const Person *> people(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            people[i] = &nodes[i]->person;
+        }
+        return write_snapshot_file(snapshot_file.c_str(), people);
+    }
+
+    bool load() {
+        // Load a saved phonebook, then replay any changes journaled since it
+        // was saved.
+        Metrics::Scope scope(metrics, Metrics::LOAD);
+        Book_Lock::Guard guard(lock, true);
+        bool found = load_save_file();
+        if (journal.is_open()) {
+            found = replay_journal() || found;
+        }
+        if (!found) {
+            std::cout << "No save file located, please save a phonebook "
+                         "before loading."
+                      << std::endl;
+        }
+        return found;
+    }
+
+    bool load_lazily() {
+        // Like load(), but return as soon as lookups can be answered and
+        // finish loading on a background thread. A current snapshot is mapped
+        // as usual and copied into nodes in the background. Otherwise the
+        // save file is indexed in one pass, find_person() reads single
+        // records out of it, and everything else waits in settle() for the
+        // background to parse the whole file. Journaled changes have to be
+        // replayed onto a tree, and readers of a thread-safe book can't take
+        // over a load, so those books load as usual.
+        Book_Lock::Guard guard(lock, true);
+        if (lock.is_enabled() || !journal.is_empty()) {
+            return load();
+        }
+        Metrics::Scope scope(metrics, Metrics::LOAD);
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        reset();
+        if (USE_SNAPSHOT && snapshot_is_current()) {
+            if (snapshot.open(snapshot_file.c_str()) && snapshot.size() > 0) {
+                count = snapshot.size();
+                load_in_background();
+                report_throughput("Mapped", start);
+                return true;
+            }
+            snapshot.close();
+        }
+        if (!save_index.open(save_file.c_str()) || save_index.size() == 0) {
+            save_index.close();
+            return load();
+        }
+        load_in_background();
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::cout << "Indexed " << save_index.size() << " records of "
+                  << save_file << " in " << seconds * 1000 << " ms"
+                  << std::endl;
+        return true;
+    }
+
+    void clear() {
+        // Empty the book.
+        Book_Lock::Guard guard(lock, true);
+        reset();
+        log_change('X', "", "", "");
+    }
+
+    bool apply(const Transaction &transaction, std::string &error) {
+        // Make every change in transaction, or none of them. Each change is
+        // checked against the book first, so a duplicate name or a missing
+        // entry rejects the whole transaction, with the reason in error,
+        // before anything is touched. The changes are then made in name
+        // order, so successive descents share most of their path. Changes to
+        // the same name keep the order they were given in. Should one still
+        // fail, those already made are undone. The journal only sees the
+        // changes once all of them are made, between markers that make replay
+        // all or nothing too.
+        Book_Lock::Guard guard(lock, true);
+        materialize();
+        const std::vector<Transaction::Change> &changes = transaction.changes;
+        std::vector<std::string> keys;
+        std::vector<size_t> order;
+        for (size_t i = 0; i < changes.size(); i++) {
+            keys.push_back(make_key(changes[i].first, changes[i].last));
+            order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [&keys](size_t a, size_t b) {
+                             return keys[a] < keys[b];
+                         });
+        // "LAST, FIRST" for error messages.
+        auto name = [&keys](size_t i) {
+            size_t split = keys[i].find('\0');
+            return keys[i].substr(0, split) + ", " +
+                   keys[i].substr(split + 1);
+        };
+
+        for (size_t i = 0; i < order.size();) {
+            // Walk through every change to one name, tracking whether the
+            // name is in the book after each of them.
+            const std::string &key = keys[order[i]];
+            const Transaction::Change &first_change = changes[order[i]];
+            bool exists = locate_name(first_change.first, first_change.last);
+            for (; i < order.size() && keys[order[i]] == key; i++) {
+                const Transaction::Change &change = changes[order[i]];
+                if (change.first.length() > UINT16_MAX ||
+                    change.last.length() > UINT16_MAX) {
+                    error = "name is too long";
+                    return false;
+                } else if (change.op == 'A' && exists) {
+                    error = "duplicate name " + name(order[i]);
+                    return false;
+                } else if (change.op != 'A' && !exists) {
+                    error = "no entry for " + name(order[i]);
+                    return false;
+                } else if (change.op == 'C' && change.phone_number.empty()) {
+                    error = "phone number cannot be blank";
+                    return false;
+                }
+                exists = change.op != 'D';
+            }
+        }
+
+        bool was_quiet = quiet;
+        quiet = true;
+        std::vector<Transaction::Change> log, undo;
+        transaction_log = &log;
+        bool applied = true;
+        try {
+            undo.reserve(order.size());
+            for (size_t i = 0; i < order.size() && applied; i++) {
+                const Transaction::Change &change = changes[order[i]];
+                if (i == 0 || keys[order[i]] != keys[order[i - 1]]) {
+                    // Before its first change, note how to put the name back
+                    // the way it was: removed (D) if it wasn't in the book,
+                    // or given its old number (A) if it was. Should copying
+                    // the name run out of memory, nothing is recorded, but
+                    // then nothing has been changed for it yet either.
+                    BST_Node *node = locate_name(change.first, change.last);
+                    undo.push_back(Transaction::Change{
+                        char(node ? 'A' : 'D'), change.first, change.last,
+                        node ? node->person.phone_number() : std::string()});
+                }
+                if (change.op == 'A') {
+                    applied = add_entry(change.first, change.last,
+                                        change.phone_number);
+                } else if (change.op == 'C') {
+                    applied = change_entry(change.first, change.last,
+                                           change.phone_number) != nullptr;
+                } else {
+                    applied = delete_entry(change.first, change.last);
+                }
+                if (!applied) {
+                    error = "could not apply the change to " + name(order[i]);
+                }
+            }
+        } catch (const std::bad_alloc &) {
+            applied = false;
+            error = "out of memory";
+            // A change cut short may have left its trigrams or versions half
+            // updated. Both are rebuilt the next time they're needed.
+            trigrams.clear();
+            versions.clear();
+        }
+        if (!applied) {
+            // Put every name touched back how it was, latest first. Nodes
+            // added along the way go back to the pool, and the journal never
+            // hears about any of it.
+            for (size_t i = undo.size(); i-- > 0;) {
+                const Transaction::Change &change = undo[i];
+                if (change.op == 'D') {
+                    delete_entry(change.first, change.last);
+                } else if (!change_entry(change.first, change.last,
+                                         change.phone_number)) {
+                    add_entry(change.first, change.last, change.phone_number);
+                }
+            }
+        }
+        transaction_log = nullptr;
+        quiet = was_quiet;
+        if (applied && !log.empty() && !replaying) {
+            journal.append('B', "", "", "");
+            for (size_t i = 0; i < log.size(); i++) {
+                journal.append(log[i].op, log[i].first, log[i].last,
+                               log[i].phone_number);
+            }
+            journal.append('E', "", "", "");
+            maybe_compact();
+        }
+        return applied;
+    }
+
+    std::vector<Person> find_by_phone(const std::string &phone_number) {
+        // Everyone listed under a phone number, in no particular order.
+        // Numbers are matched on their digits alone, so "866-158-2550" finds
+        // 8661582550. Like find_person the results are copies.
+        Metrics::Scope scope(metrics, Metrics::PHONE);
+        std::string key = normalize_phone(phone_number);
+        std::vector<Person> results;
+        settle();
+        while (true) {
+            {
+                Book_Lock::Guard guard(lock, false);
+                if (!snapshot.is_open()) {
+                    auto matches = phone_index.equal_range(key);
+                    for (auto it = matches.first; it != matches.second; ++it) {
+                        results.push_back(it->second->person);
+                    }
+                    return results;
+                }
+            }
+            // The index only covers nodes in the tree.
+            Book_Lock::Guard guard(lock, true);
+            materialize();
+        }
+    }
+
+    std::vector<Person> fuzzy_search(std::string text, size_t limit) {
+        // Up to limit entries whose names are within a few typos of text,
+        // closest first. text is either a last name or "LAST,FIRST".
+        Metrics::Scope scope(metrics, Metrics::FUZZY);
+        std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+        std::vector<Person> results;
+        settle();
+        while (true) {
+            {
+                Book_Lock::Guard guard(lock, false);
+                if (!snapshot.is_open() && trigrams.is_built()) {
+                    std::vector<BST_Node *> nodes =
+                        trigrams.search(text, limit);
+                    for (size_t i = 0; i < nodes.size(); i++) {
+                        results.push_back(nodes[i]->person);
+                    }
+                    return results;
+                }
+            }
+            // Building the index (and the tree under it) needs the exclusive
+            // lock.
+            Book_Lock::Guard guard(lock, true);
+            materialize();
+            if (!trigrams.is_built()) {
+                std::vector<BST_Node *> nodes;
+                sorted_nodes(nodes);
+                trigrams.build(nodes);
+            }
+        }
+    }
+
+    Cursor lower_bound(std::string first, std::string last) {
+        // Every entry from first last onwards.
+        Metrics::Scope scope(metrics, Metrics::RANGE);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        return Cursor(*this, make_key(first, last), true,
+                      Cursor::UNBOUNDED, "");
+    }
+
+    Cursor upper_bound(std::string first, std::string last) {
+        // Every entry after first last.
+        Metrics::Scope scope(metrics, Metrics::RANGE);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        return Cursor(*this, make_key(first, last), false,
+                      Cursor::UNBOUNDED, "");
+    }
+
+    Cursor range(std::string from_first, std::string from_last,
+                 std::string to_first, std::string to_last) {
+        // Every entry between the two names, both ends included. An empty
+        // first name at the top of the range takes in everyone with that
+        // last name.
+        Metrics::Scope scope(metrics, Metrics::RANGE);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        std::string to = make_key(to_first, to_last);
+        if (to_first.empty()) {
+            // "LAST\1" sorts after "LAST\0" followed by any first name.
+            to.back() = '\1';
+        }
+        return Cursor(*this, make_key(from_first, from_last), true,
+                      Cursor::UP_TO, to);
+    }
+
+    Cursor prefix(std::string text) {
+        // Every entry whose last name starts with text. Given as
+        // "LAST,FIRST" the last name has to match exactly and the first name
+        // start with FIRST.
+        Metrics::Scope scope(metrics, Metrics::RANGE);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+        size_t comma = text.find(',');
+        if (comma != std::string::npos) {
+            text[comma] = '\0';
+        }
+        return Cursor(*this, text, true, Cursor::PREFIX, text);
+    }
+
+    bool select(size_t rank, Person &result) {
+        // Copy out the entry at position rank in alphabetical order, counting
+        // from 1 like the rows of display_book. Returns false if the book
+        // has fewer entries.
+        Metrics::Scope scope(metrics, Metrics::RANK);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        return person_at(rank, result);
+    }
+
+    size_t rank(std::string first, std::string last) {
+        // The position first last has in alphabetical order, counting from
+        // 1, or would have if it were added.
+        Metrics::Scope scope(metrics, Metrics::RANK);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        std::string key = make_key(first, last);
+        return count_below(key.data(), key.length()) + 1;
+    }
+
+    Cursor from_rank(size_t rank) {
+        // Every entry from position rank onwards.
+        Metrics::Scope scope(metrics, Metrics::RANK);
+        Book_Lock::Guard guard(lock, false);
+        settle();
+        Person p;
+        if (!person_at(rank, p)) {
+            // Past the end, so a cursor that's already finished.
+            Cursor cursor(*this, "", true, Cursor::UNBOUNDED, "");
+            cursor.done = true;
+            return cursor;
+        }
+        return Cursor(*this, std::string(p.key, p.key_length()), true,
+                      Cursor::UNBOUNDED, "");
+    }
+
+    int height() {
+        // Height of the tree. An attached snapshot has no tree yet.
+        Book_Lock::Guard guard(lock, false);
+        return use_bplus_tree ? bplus_tree.height() : node_height(head);
+    }
+
+    void print_statistics(std::ostream &out) {
+        // The shape of the tree, the memory behind it and the operation
+        // metrics collected so far.
+        Book_Lock::Guard guard(lock, false);
+        if (snapshot.is_open()) {
+            out << count << " entries in a mapped snapshot, no tree built yet"
+                << std::endl;
+        } else if (save_index.is_open()) {
+            out << save_index.size() << " records indexed in " << save_file
+                << ", still loading" << std::endl;
+        } else if (use_bplus_tree) {
+            size_t leaves = bplus_tree.leaf_count();
+            out << count << " entries, B+-tree height " << bplus_tree.height()
+                << ", " << leaves << " leaves "
+                << (leaves ? 100.0 * count / (leaves * BPLUS_TREE_FANOUT) : 0.0)
+                << "% full, " << bplus_tree.inner_count() << " inner nodes, "
+                << bplus_tree.bytes() / 1024 << " KB" << std::endl;
+        } else {
+            // Walk the tree keeping each node's depth alongside it.
+            size_t leaves = 0, total_depth = 0;
+            std::vector<std::pair<BST_Node *, size_t>> stack;
+            if (head) {
+                stack.push_back(std::make_pair(head, size_t(1)));
+            }
+            while (!stack.empty()) {
+                BST_Node *node = stack.back().first;
+                size_t depth = stack.back().second;
+                stack.pop_back();
+                total_depth += depth;
+                if (!node->left && !node->right) {
+                    leaves++;
+                }
+                if (node->left) {
+                    stack.push_back(std::make_pair(node->left, depth + 1));
+                }
+                if (node->right) {
+                    stack.push_back(std::make_pair(node->right, depth + 1));
+                }
+            }
+            int minimum_height = 0;
+            for (size_t n = count; n; n >>= 1) {
+                minimum_height++;
+            }
+            out << count << " entries, tree height " << node_height(head)
+                << " (at best " << minimum_height << "), average depth "
+                << (count ? double(total_depth) / count : 0.0) << ", "
+                << leaves << " leaves" << std::endl;
+        }
+        out << "Node pool " << pool.bytes() / 1024 << " KB, string arena "
+            << arena->bytes() / 1024 << " KB, " << phone_index.size()
+            << " phone numbers indexed" << std::endl;
+        out << std::endl;
+        metrics.print(out);
+    }
+
+    void set_quiet(bool quiet) {
+        // Stop (or start) printing messages about failed operations, for
+        // callers that report failures themselves.
+        Book_Lock::Guard guard(lock, true);
+        this->quiet = quiet;
+    }
+
+    bool is_empty() {
+        Book_Lock::Guard guard(lock, false);
+        // An attached snapshot is never empty, see load(), and nor is a save
+        // file being loaded, see load_lazily().
+        if (snapshot.is_open() || save_index.is_open()) {
+            return false;
+        }
+        if (use_bplus_tree) {
+            return count == 0;
+        }
+        if (!head && count != 0) {
+            throw std::runtime_error("Error: Node count mismatch. Head doesn't "
+                                     "exist but the count isn't zero!");
+        }
+        return !head;
+    }
+
+  private:
+    // Drives shards of a book from their worker threads.
+    friend class Sharded_Book;
+    // Only does anything in a thread-safe book.
+    Book_Lock lock;
+    BST_Node *head;
+    int count;
+    // Changes are appended here unless they're being replayed from it.
+    Journal journal;
+    bool replaying;
+    // While a transaction is being applied its changes are held back here,
+    // and only journaled once every one of them has been made.
+    std::vector<Transaction::Change> *transaction_log;
+    // Suppress the console messages the book prints about failed operations.
+    bool quiet;
+    // Rebalance the tree after every insertion and deletion.
+    bool balanced;
+    // Keep the nodes in bplus_tree rather than linking them into a tree of
+    // their own under head.
+    bool use_bplus_tree;
+    BPlus_Tree bplus_tree;
+    // Every node in the tree lives in this pool, and their text in the arena.
+    Node_Pool pool;
+    // Shared with any versions that still point at the text.
+    std::shared_ptr<String_Arena> arena;
+    // While open, the book's entries live in this snapshot and the tree is
+    // empty. Anything that needs real nodes calls materialize() first.
+    Snapshot snapshot;
+    struct Background_Load {
+        // Nodes read on another thread. The thread touches nothing else, and
+        // finish_loading() hands them over to the book once it's joined.
+        std::thread worker;
+        Node_Pool pool;
+        String_Arena arena;
+        // Sorted. Names can repeat when they come from the save file.
+        std::vector<BST_Node *> nodes;
+        std::vector<std::string> errors;
+        size_t malformed;
+        // The snapshot failed its checksum.
+        bool corrupt;
+
+        Background_Load() : malformed(0), corrupt(false) {}
+    };
+
+    // A book started by load_lazily() builds its tree on this thread. While
+    // the save file itself is being loaded it's indexed here, and the tree
+    // is empty as with a snapshot. Anything that can't be answered from the
+    // index calls settle() first.
+    std::unique_ptr<Background_Load> loading;
+    Save_Index save_index;
+    // Every node in the tree, keyed by its normalized phone number. Several
+    // people can share a number.
+    std::unordered_multimap<std::string, BST_Node *> phone_index;
+    // Built by the first fuzzy search.
+    Trigram_Index trigrams;
+    // Built by the first freeze().
+    Version_Tree versions;
+    // Held for the whole of a save made from a version, which mostly runs
+    // without the book's lock.
+    std::mutex saving;
+    Metrics metrics;
+    // Where save(), load() and the journal keep the book.
+    std::string save_file, snapshot_file, journal_file;
+
+    BST_Node *insertion(BST_Node *ptr, BST_Node *new_node) {
+        // Walk down from ptr until we find an empty slot for the new node.
+        while (true) {
+            // Check whether or not the new node is less than the pointer
+            if (compare_names(ptr->person, new_node->person) == 1) {
+                // If new_node belongs to the left of the pointer but the left
+                // child is nullptr then we can assign it to be the new_node.
+                if (!ptr->left) {
+                    ptr->left = new_node;
+                    break;
+                }
+
+                // Otherwise, we can continue down to the left.
+                ptr = ptr->left;
+            } else if (compare_names(new_node->person, ptr->person) == 1) {
+                // Same process as above just for the right side.
+                if (!ptr->right) {
+                    ptr->right = new_node;
+                    break;
+                }
+                ptr = ptr->right;
+            } else {
+                if (!quiet) {
+                    std::cout << "\nName already exists in phonebook\n"
+                              << std::endl;
+                }
+                return nullptr;
+            }
+        }
+
+        new_node->parent = ptr;
+        count++;
+        retrace(ptr);
+        return new_node;
+    }
+
+    bool bplus_insertion(BST_Node *new_node) {
+        // insertion() for a book kept in a B+-tree.
+        if (!bplus_tree.insert(new_node)) {
+            if (!quiet) {
+                std::cout << "\nName already exists in phonebook\n"
+                          << std::endl;
+            }
+            return false;
+        }
+        count++;
+        return true;
+    }
+
+    bool load_save_file() {
+        // Load the book as of the last save. A snapshot at least as new as
+        // the text file gets mapped instead of parsed.
+        if (USE_SNAPSHOT && snapshot_is_current()) {
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            reset();
+            if (snapshot.open(snapshot_file.c_str()) && snapshot.size() > 0) {
+                count = snapshot.size();
+                report_throughput("Mapped", start);
+                return true;
+            }
+            // Fall back to the text file if the snapshot is unusable.
+            snapshot.close();
+        }
+
+        // Clear the phonebook if we're going to load a new one in.
+        reset();
+        std::ifstream File(save_file);
+        if (!File.good()) {
+            // Ensure the save file exists.
+            File.close();
+            return false;
+        }
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        unsigned threads = std::thread::hardware_concurrency();
+        struct stat info;
+        if (BULK_LOAD && threads > 1 && stat(save_file.c_str(), &info) == 0 &&
+            size_t(info.st_size) >= PARALLEL_LOAD_MIN_BYTES &&
+            parallel_load(save_file.c_str(), threads)) {
+            report_throughput("Loaded", start);
+            return true;
+        }
+        CSV_Parser parser(File);
+        if (BULK_LOAD) {
+            bulk_load(parser);
+        } else {
+            Field fields[3];
+            while (parser.next(fields)) {
+                // Decode the file record by record and build a new tree based
+                // on the nodes read.
+                add_entry(fields[0].str(), fields[1].str(), fields[2].str());
+            }
+        }
+
+        File.close();
+        report_parse_errors(parser.errors(), parser.malformed_lines());
+        report_throughput("Loaded", start);
+        return true;
+    }
+
+    void report_parse_errors(const std::vector<std::string> &errors,
+                             size_t malformed) {
+        for (size_t i = 0; i < errors.size(); i++) {
+            std::cout << errors[i] << std::endl;
+        }
+        if (malformed > 0) {
+            std::cout << "Skipped " << malformed << " malformed lines in "
+                      << save_file << std::endl;
+        }
+    }
+
+    bool replay_journal() {
+        // Apply the journaled changes on top of the save file. Replay stops
+        // at the first damaged record; anything after it was never
+        // acknowledged as synced. The changes of a transaction sit between a
+        // B and an E record and are only applied once its E is read.
+        std::ifstream File(journal_file);
+        if (!File.good()) {
+            return false;
+        }
+        CSV_Parser parser(File, 5);
+        Field fields[5];
+        size_t replayed = 0;
+        bool damaged = false;
+        bool in_transaction = false;
+        Transaction transaction;
+        bool was_quiet = quiet;
+        replaying = true;
+        quiet = true;
+        while (parser.next(fields) && parser.malformed_lines() == 0) {
+            std::string op = fields[0].str(), first = fields[1].str(),
+                        last = fields[2].str(), phone_number = fields[3].str();
+            if (op.length() != 1 ||
+                fields[4].str() != std::to_string(Journal::checksum(
+                                       op[0], first, last, phone_number))) {
+                damaged = true;
+                break;
+            }
+            if (op[0] == 'B') {
+                in_transaction = true;
+                transaction.clear();
+            } else if (op[0] == 'E') {
+                // A save that already holds the transaction (see
+                // rewrite_save()) makes it fail its checks. Its changes then
+                // go in one at a time like any others, and the last change to
+                // each name still decides how it ends up.
+                std::string error;
+                if (!apply(transaction, error)) {
+                    const std::vector<Transaction::Change> &changes =
+                        transaction.changes;
+                    for (size_t i = 0; i < changes.size(); i++) {
+                        replay_change(changes[i].op, changes[i].first,
+                                      changes[i].last, changes[i].phone_number);
+                    }
+                }
+                in_transaction = false;
+            } else if (in_transaction) {
+                transaction.changes.push_back(
+                    Transaction::Change{op[0], first, last, phone_number});
+            } else {
+                replay_change(op[0], first, last, phone_number);
+            }
+            replayed++;
+        }
+        // A transaction cut off by a crash is dropped as a whole.
+        damaged = damaged || in_transaction;
+        replaying = false;
+        quiet = was_quiet;
+        File.close();
+
+        journal.set_size(replayed);
+        if (replayed > 0) {
+            std::cout << "Replayed " << replayed << " journaled changes"
+                      << std::endl;
+        }
+        if (damaged || parser.malformed_lines() > 0) {
+            // Rewrite the save files so new records don't land after the
+            // damaged ones.
+            std::cout << "Discarded a damaged record at the end of "
+                      << journal_file << std::endl;
+            compact();
+        }
+        return replayed > 0;
+    }
+
+    void replay_change(char op, const std::string &first,
+                       const std::string &last,
+                       const std::string &phone_number) {
+        if (op == 'A') {
+            add_entry(first, last, phone_number);
+        } else if (op == 'C') {
+            change_entry(first, last, phone_number);
+        } else if (op == 'D') {
+            delete_entry(first, last);
+        } else if (op == 'X') {
+            reset();
+        }
+    }
+
+    void log_change(char op, const std::string &first, const std::string &last,
+                    const std::string &phone_number) {
+        // Journal a change that just succeeded.
+        if (replaying) {
+            return;
+        }
+        if (transaction_log) {
+            transaction_log->push_back(
+                Transaction::Change{op, first, last, phone_number});
+            return;
+        }
+        journal.append(op, first, last, phone_number);
+        maybe_compact();
+    }
+
+    void maybe_compact() {
+        if (!replaying && journal.size() >= JOURNAL_COMPACT_AFTER) {
+            compact();
+        }
+    }
+
+    Version current_version() {
+        // The caller holds the lock and has built the versions.
+        Version version;
+        version.root = versions.root();
+        version.arena = arena;
+        version.entries = count;
+        return version;
+    }
+
+    bool save_version() {
+        // Save from a frozen version. The book's lock is only held to freeze
+        // it and mark the journal, and again to drop the journal records the
+        // save now covers, so changes made while the files are written go on
+        // as usual and stay in the journal.
+        std::lock_guard<std::mutex> save_guard(saving);
+        Version version;
+        size_t mark;
+        {
+            Book_Lock::Guard guard(lock, true);
+            if (is_empty()) {
+                return false;
+            }
+            version = freeze();
+            mark = journal.mark();
+        }
+        if (!version.write_text(save_file.c_str())) {
+            return false;
+        }
+        // Written after the text file so it never looks older than it.
+        if (USE_SNAPSHOT && !version.write_snapshot(snapshot_file.c_str())) {
+            return false;
+        }
+        Book_Lock::Guard guard(lock, true);
+        return journal.drop_before(mark);
+    }
+
+    bool compact() {
+        // Write the whole book out as a fresh save and empty the journal. A
+        // save from a version already under way is left to finish instead,
+        // as waiting for it here would hold the lock it needs, and false is
+        // returned as nothing was written. That's only safe for changes the
+        // journal holds; a caller with changes it doesn't takes saving
+        // before the book's lock and calls rewrite_save() itself.
+        std::unique_lock<std::mutex> save_guard(saving, std::try_to_lock);
+        if (!save_guard.owns_lock()) {
+            return false;
+        }
+        return rewrite_save();
+    }
+
+    bool rewrite_save() {
+        // compact() for a caller that already holds saving. The journal is
+        // only emptied once the save is safely on disk. If we crash in
+        // between, replaying records the save already contains does no harm,
+        // because the last change to each name decides how it ends up.
+        materialize();
+        if (!write_text()) {
+            return false;
+        }
+        // Written after the text file so it never looks older than it.
+        if (USE_SNAPSHOT) {
+            if (is_empty()) {
+                std::remove(snapshot_file.c_str());
+            } else if (!save_snapshot()) {
+                return false;
+            }
+        }
+        return journal.reset();
+    }
+
+    bool write_text() {
+        // Write the book in pre order, so reloading it one entry at a time
+        // rebuilds the same tree. A B+-tree has no such order, so it's
+        // written in name order, which bulk loading doesn't need to sort.
+        if (use_bplus_tree) {
+            std::vector<BST_Node *> nodes;
+            sorted_nodes(nodes);
+            std::vector<const Person *> people(nodes.size());
+            for (size_t i = 0; i < nodes.size(); i++) {
+                people[i] = &nodes[i]->person;
+            }
+            return write_save_file(save_file.c_str(), people);
+        }
+        // Create a list to store the nodes as we do a preorder traversal.
+        BST_Node **preorder_list = new BST_Node *[count];
+        size_t counter = 0;
+        build_preorder_list(head, preorder_list, counter);
+        std::vector<const Person *> people(counter);
+        for (size_t i = 0; i < counter; i++) {
+            people[i] = &preorder_list[i]->person;
+        }
+        // Clean up the list we used.
+        delete[] preorder_list;
+        return write_save_file(save_file.c_str(), people);
+    }
+
+    static bool write_save_file(const char *path,
+                                const std::vector<const Person *> &people) {
+        // Write people to a temporary file in the given order, then move it
+        // into place.
+        std::string temporary = std::string(path) + ".tmp";
+        std::ofstream File(temporary, std::ios::trunc);
+        // Encode a line for each entry.
+        for (size_t i = 0; i < people.size(); i++) {
+            File << people[i]->encode();
+            if (i < people.size() - 1) {
+                File << "\n";
+            }
+        }
+        // Close the file.
+        File.close();
+        if (!File) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return replace_file(temporary, path);
+    }
+
+    static bool write_snapshot_file(const char *path,
+                                    const std::vector<const Person *> &sorted) {
+        std::vector<Snapshot_Record> records;
+        records.reserve(sorted.size());
+        std::string strings;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            const Person &p = *sorted[i];
+            Snapshot_Record record;
+            record.key_prefix = p.key_prefix;
+            record.phone_digits = p.phone_digits;
+            record.key_offset = strings.size();
+            record.last_length = p.last_length;
+            record.first_length = p.first_length;
+            record.reserved = 0;
+            records.push_back(record);
+            strings.append(p.key, p.text_length());
+        }
+        return Snapshot::write(path, records, strings);
+    }
+
+    void reset() {
+        // Nodes and their text need no destruction, so clearing out the BST is
+        // just handing the pool's and arena's blocks back in one go.
+        if (loading) {
+            // Whatever it read goes with its own pool and arena.
+            loading->worker.join();
+            loading.reset();
+        }
+        save_index.close();
+        snapshot.close();
+        pool.release_all();
+        if (arena.use_count() > 1) {
+            // A version still points into the text, so leave it the old
+            // arena and start a new one.
+            arena = std::make_shared<String_Arena>();
+        } else {
+            arena->release_all();
+        }
+        phone_index.clear();
+        trigrams.clear();
+        versions.clear();
+        bplus_tree.clear();
+        head = nullptr;
+        count = 0;
+    }
+
+    void materialize() {
+        // Build the tree from the attached snapshot, if there is one. The
+        // records are already sorted and unique, so the nodes can be linked
+        // up directly.
+        if (loading) {
+            finish_loading();
+            return;
+        }
+        if (!snapshot.is_open()) {
+            return;
+        }
+        if (!snapshot.verify()) {
+            std::cout << "\n" << snapshot_file
+                      << " is corrupt, starting with an empty phonebook\n"
+                      << std::endl;
+            reset();
+            return;
+        }
+        std::vector<BST_Node *> nodes;
+        nodes.reserve(snapshot.size());
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            Person p = snapshot.person(i);
+            p.key = arena->store(p.key, p.text_length());
+            nodes.push_back(pool.acquire(p));
+        }
+        snapshot.close();
+        build_balanced(nodes);
+    }
+
+    void settle() {
+        // Finish loading a save file that only find_person() can answer from
+        // yet. load_lazily() only leaves one in a book that isn't thread-safe,
+        // so this is safe under a reader's guard.
+        if (save_index.is_open()) {
+            if (lock.is_enabled()) {
+                throw std::logic_error(
+                    "Error: Thread-safe book left loading from its save file");
+            }
+            finish_loading();
+        }
+    }
+
+    void load_in_background() {
+        // Start reading the attached snapshot, or else the save file, into
+        // nodes on another thread.
+        loading.reset(new Background_Load());
+        Background_Load *load = loading.get();
+        if (snapshot.is_open()) {
+            const Snapshot *source = &snapshot;
+            load->worker = std::thread([load, source]() {
+                if (!source->verify()) {
+                    load->corrupt = true;
+                    return;
+                }
+                load->nodes.reserve(source->size());
+                for (size_t i = 0; i < source->size(); i++) {
+                    Person p = source->person(i);
+                    p.key = load->arena.store(p.key, p.text_length());
+                    load->nodes.push_back(load->pool.acquire(p));
+                }
+            });
+        } else {
+            std::string path = save_file;
+            load->worker = std::thread([load, path]() {
+                std::ifstream File(path);
+                CSV_Parser parser(File);
+                parse_sorted_nodes(parser, load->pool, load->arena,
+                                   load->nodes);
+                load->errors = parser.errors();
+                load->malformed = parser.malformed_lines();
+            });
+        }
+    }
+
+    void finish_loading() {
+        // Wait for the background load and build the tree from its nodes.
+        // A save file read this way gets a snapshot written for it, so the
+        // next start can map that instead of indexing the file again.
+        loading->worker.join();
+        std::unique_ptr<Background_Load> load(std::move(loading));
+        if (load->corrupt) {
+            std::cout << "\n" << snapshot_file
+                      << " is corrupt, starting with an empty phonebook\n"
+                      << std::endl;
+            reset();
+            return;
+        }
+        pool.adopt(load->pool);
+        arena->adopt(load->arena);
+        bool from_save_file = save_index.is_open();
+        save_index.close();
+        snapshot.close();
+        if (!from_save_file) {
+            build_balanced(load->nodes);
+            return;
+        }
+        report_parse_errors(load->errors, load->malformed);
+        build_unique(load->nodes);
+        if (USE_SNAPSHOT && !is_empty()) {
+            std::vector<const Person *> people(load->nodes.size());
+            for (size_t i = 0; i < load->nodes.size(); i++) {
+                people[i] = &load->nodes[i]->person;
+            }
+            write_snapshot_file(snapshot_file.c_str(), people);
+        }
+    }
+
+    bool snapshot_is_current() {
+        // Whether the snapshot exists and the text file isn't newer.
+        struct stat snapshot_info, text_info;
+        if (stat(snapshot_file.c_str(), &snapshot_info) != 0) {
+            return false;
+        }
+        return stat(save_file.c_str(), &text_info) != 0 ||
+               snapshot_info.st_mtime >= text_info.st_mtime;
+    }
+
+    void bulk_load(CSV_Parser &parser) {
+        // Turn every record into a node up front, sort the nodes once (the
+        // save file is in pre order, but skip the sort if the input happens to
+        // be sorted already), drop duplicate names and build the tree bottom
+        // up.
+        std::vector<BST_Node *> nodes;
+        parse_sorted_nodes(parser, pool, *arena, nodes);
+        build_unique(nodes);
+    }
+
+    static void parse_sorted_nodes(CSV_Parser &parser, Node_Pool &pool,
+                                   String_Arena &arena,
+                                   std::vector<BST_Node *> &nodes) {
+        // Make a node out of every record, allocated from the given pool and
+        // arena, and sort them.
+        std::string buffer;
+        Field fields[3];
+        while (parser.next(fields)) {
+            if (fields[0].length > UINT16_MAX ||
+                fields[1].length > UINT16_MAX) {
+                continue;
+            }
+            // The names are uppercased where they sit in the parser's buffer,
+            // so the record is only copied once it's packed.
+            std::transform(fields[0].data, fields[0].data + fields[0].length,
+                           fields[0].data, ::toupper);
+            std::transform(fields[1].data, fields[1].data + fields[1].length,
+                           fields[1].data, ::toupper);
+            Person p =
+                Person::pack(fields[0].data, fields[0].length, fields[1].data,
+                             fields[1].length, fields[2].data,
+                             fields[2].length, buffer);
+            p.key = arena.store(buffer);
+            nodes.push_back(pool.acquire(p));
+        }
+
+        bool sorted = true;
+        for (size_t i = 1; i < nodes.size() && sorted; i++) {
+            sorted =
+                Person::compare(nodes[i - 1]->person, nodes[i]->person) <= 0;
+        }
+        if (!sorted) {
+            // Stable, so that like add_entry the first copy of a name wins.
+            std::stable_sort(nodes.begin(), nodes.end(),
+                             [](BST_Node *a, BST_Node *b) {
+                                 return Person::compare(a->person, b->person) <
+                                        0;
+                             });
+        }
+    }
+
+    bool parallel_load(const char *path, unsigned threads) {
+        // Bulk load on several threads. The file is cut into one chunk per
+        // thread on record boundaries, each thread parses its chunk into
+        // sorted nodes from a pool and arena of its own, and the sorted runs
+        // are merged pairwise in parallel. Only the final dedupe and build
+        // run on one thread. Returns false, having loaded nothing, if the
+        // file can't be mapped.
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size_t size = info.st_size;
+        // Private and writable only so the parser's pointers can be char *.
+        // Nothing is written, so no page gets copied.
+        void *mapping =
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        char *data = static_cast<char *>(mapping);
+
+        struct Chunk {
+            // The chunk's share of the file before it's moved onto a record
+            // boundary, and what that share holds.
+            size_t nominal_begin, nominal_end;
+            size_t quotes, newlines;
+            // The records it actually parses, and the line they start on.
+            size_t begin, end, line;
+            Node_Pool pool;
+            String_Arena arena;
+            std::vector<BST_Node *> nodes;
+            std::vector<std::string> errors;
+            size_t malformed;
+        };
+        std::vector<Chunk> chunks(threads);
+        for (size_t i = 0; i < threads; i++) {
+            chunks[i].nominal_begin = size * i / threads;
+            chunks[i].nominal_end = size * (i + 1) / threads;
+        }
+        auto run = [&](std::function<void(Chunk &)> work) {
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < threads; i++) {
+                workers.push_back(std::thread(work, std::ref(chunks[i])));
+            }
+            for (size_t i = 0; i < threads; i++) {
+                workers[i].join();
+            }
+        };
+
+        // A newline only ends a record outside quotes, so count quotes (and
+        // newlines, for line numbers) in every chunk at once. Whether a
+        // chunk starts inside quotes is then the parity of the quotes
+        // before it.
+        run([data](Chunk &chunk) {
+            chunk.quotes = chunk.newlines = 0;
+            char *p = data + chunk.nominal_begin;
+            char *limit = data + chunk.nominal_end;
+            while ((p = CSV_Parser::find_any(p, limit, '"', '\n')) < limit) {
+                (*p == '"' ? chunk.quotes : chunk.newlines)++;
+                p++;
+            }
+        });
+        size_t quotes = 0, newlines = 0;
+        chunks[0].begin = 0;
+        chunks[0].line = 1;
+        for (size_t i = 1; i < threads; i++) {
+            quotes += chunks[i - 1].quotes;
+            newlines += chunks[i - 1].newlines;
+            // Walk on to the first newline outside quotes.
+            bool quoted = quotes % 2 == 1;
+            size_t line = newlines + 1;
+            char *p = data + chunks[i].nominal_begin;
+            char *limit = data + size;
+            while ((p = CSV_Parser::find_any(p, limit, '"', '\n')) < limit) {
+                if (*p == '"') {
+                    quoted = !quoted;
+                } else {
+                    line++;
+                    if (!quoted) {
+                        p++;
+                        break;
+                    }
+                }
+                p++;
+            }
+            chunks[i].begin = std::max<size_t>(p - data, chunks[i - 1].begin);
+            chunks[i].line = line;
+            chunks[i - 1].end = chunks[i].begin;
+        }
+        chunks[threads - 1].end = size;
+
+        run([data](Chunk &chunk) {
+            Memory_Buffer memory(data + chunk.begin, data + chunk.end);
+            std::istream input(&memory);
+            CSV_Parser parser(input, 3, chunk.line);
+            parse_sorted_nodes(parser, chunk.pool, chunk.arena, chunk.nodes);
+            chunk.errors = parser.errors();
+            chunk.malformed = parser.malformed_lines();
+        });
+        munmap(mapping, size);
+
+        std::vector<std::string> errors;
+        size_t malformed = 0;
+        std::vector<std::vector<BST_Node *>> runs;
+        for (size_t i = 0; i < threads; i++) {
+            pool.adopt(chunks[i].pool);
+            arena->adopt(chunks[i].arena);
+            for (size_t e = 0; e < chunks[i].errors.size() &&
+                               errors.size() < MAX_REPORTED_PARSE_ERRORS;
+                 e++) {
+                errors.push_back(chunks[i].errors[e]);
+            }
+            malformed += chunks[i].malformed;
+            runs.push_back(std::vector<BST_Node *>());
+            runs.back().swap(chunks[i].nodes);
+        }
+
+        // Merge neighbouring runs until one is left. std::merge takes from
+        // the earlier run first on ties, so the first copy of a name in the
+        // file still wins.
+        while (runs.size() > 1) {
+            std::vector<std::vector<BST_Node *>> merged((runs.size() + 1) / 2);
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+                workers.push_back(std::thread([&runs, &merged, i]() {
+                    std::vector<BST_Node *> &out = merged[i / 2];
+                    out.resize(runs[i].size() + runs[i + 1].size());
+                    std::merge(runs[i].begin(), runs[i].end(),
+                               runs[i + 1].begin(), runs[i + 1].end(),
+                               out.begin(), [](BST_Node *a, BST_Node *b) {
+                                   return Person::compare(a->person,
+                                                          b->person) < 0;
+                               });
+                    std::vector<BST_Node *>().swap(runs[i]);
+                    std::vector<BST_Node *>().swap(runs[i + 1]);
+                }));
+            }
+            if (runs.size() % 2 == 1) {
+                merged.back().swap(runs.back());
+            }
+            for (size_t i = 0; i < workers.size(); i++) {
+                workers[i].join();
+            }
+            runs.swap(merged);
+        }
+
+        report_parse_errors(errors, malformed);
+        build_unique(runs[0]);
+        return true;
+    }
+
+    void build_unique(std::vector<BST_Node *> &nodes) {
+        // Drop all but the first of each run of equal names from sorted
+        // nodes, then build the tree from what's left.
+        size_t kept = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (kept > 0 &&
+                compare_names(nodes[kept - 1]->person, nodes[i]->person) == 0) {
+                pool.release(nodes[i]);
+                continue;
+            }
+            nodes[kept++] = nodes[i];
+        }
+        if (kept < nodes.size()) {
+            std::cout << "Skipped " << nodes.size() - kept
+                      << " duplicate names" << std::endl;
+        }
+        nodes.resize(kept);
+        build_balanced(nodes);
+    }
+
+    void build_balanced(std::vector<BST_Node *> &sorted) {
+        // Link already sorted, unique nodes into a perfectly balanced tree in
+        // O(n). Each range's middle node becomes the root of that range, and
+        // ranges wait on an explicit stack rather than in recursive calls.
+        struct Range {
+            size_t begin, end;
+            BST_Node *parent;
+            BST_Node **link;
+        };
+        std::vector<Range> ranges;
+        head = nullptr;
+        if (use_bplus_tree) {
+            // Packed into full leaves instead, also in O(n).
+            bplus_tree.build(sorted);
+        } else {
+            ranges.push_back(Range{0, sorted.size(), nullptr, &head});
+        }
+        while (!ranges.empty()) {
+            Range range = ranges.back();
+            ranges.pop_back();
+            if (range.begin == range.end) {
+                *range.link = nullptr;
+                continue;
+            }
+            size_t middle = range.begin + (range.end - range.begin) / 2;
+            BST_Node *node = sorted[middle];
+            node->parent = range.parent;
+            // Splitting on the middle gives a subtree of n nodes a height
+            // equal to the bit length of n.
+            node->size = range.end - range.begin;
+            node->height = 0;
+            for (size_t n = range.end - range.begin; n; n >>= 1) {
+                node->height++;
+            }
+            *range.link = node;
+            ranges.push_back(Range{range.begin, middle, node, &node->left});
+            ranges.push_back(Range{middle + 1, range.end, node, &node->right});
+        }
+        count = sorted.size();
+        phone_index.clear();
+        phone_index.reserve(sorted.size());
+        for (size_t i = 0; i < sorted.size(); i++) {
+            index_phone(sorted[i]);
+        }
+        trigrams.clear();
+        versions.clear();
+    }
+
+    void report_throughput(const char *action,
+                           std::chrono::steady_clock::time_point start) {
+        // Print how long a bulk operation on the whole book took.
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        std::cout << action << " " << count << " entries in "
+                  << seconds * 1000 << " ms";
+        if (seconds > 0) {
+            std::cout << " (" << static_cast<long long>(count / seconds)
+                      << " entries/sec)";
+        }
+        std::cout << std::endl;
+    }
+
+    int node_height(BST_Node *ptr) { return ptr ? ptr->height : 0; }
+
+    size_t node_size(BST_Node *ptr) { return ptr ? ptr->size : 0; }
+
+    void update_height(BST_Node *ptr) {
+        // Subtree sizes change in exactly the places heights do, so they're
+        // kept up to date together.
+        ptr->height =
+            1 + std::max(node_height(ptr->left), node_height(ptr->right));
+        ptr->size = 1 + node_size(ptr->left) + node_size(ptr->right);
+    }
+
+    void replace_child(BST_Node *parent, BST_Node *old_child,
+                       BST_Node *new_child) {
+        // Point whatever referenced old_child at new_child instead.
+        if (!parent) {
+            head = new_child;
+        } else if (parent->left == old_child) {
+            parent->left = new_child;
+        } else {
+            parent->right = new_child;
+        }
+        if (new_child) {
+            new_child->parent = parent;
+        }
+    }
+
+    BST_Node *rotate_left(BST_Node *ptr) {
+        // The right child takes ptr's place and ptr becomes its left child.
+        BST_Node *pivot = ptr->right;
+        replace_child(ptr->parent, ptr, pivot);
+        ptr->right = pivot->left;
+        if (ptr->right) {
+            ptr->right->parent = ptr;
+        }
+        pivot->left = ptr;
+        ptr->parent = pivot;
+        update_height(ptr);
+        update_height(pivot);
+        return pivot;
+    }
+
+    BST_Node *rotate_right(BST_Node *ptr) {
+        // Mirror image of rotate_left.
+        BST_Node *pivot = ptr->left;
+        replace_child(ptr->parent, ptr, pivot);
+        ptr->left = pivot->right;
+        if (ptr->left) {
+            ptr->left->parent = ptr;
+        }
+        pivot->right = ptr;
+        ptr->parent = pivot;
+        update_height(ptr);
+        update_height(pivot);
+        return pivot;
+    }
+
+    void retrace(BST_Node *ptr) {
+        // Walk from ptr back up to the root fixing heights. In balanced mode,
+        // any node whose subtrees differ in height by more than one gets
+        // rotated back into shape (AVL).
+        while (ptr) {
+            update_height(ptr);
+            if (balanced) {
+                int balance = node_height(ptr->left) - node_height(ptr->right);
+                if (balance > 1) {
+                    if (node_height(ptr->left->left) <
+                        node_height(ptr->left->right)) {
+                        rotate_left(ptr->left);
+                    }
+                    ptr = rotate_right(ptr);
+                } else if (balance < -1) {
+                    if (node_height(ptr->right->right) <
+                        node_height(ptr->right->left)) {
+                        rotate_right(ptr->right);
+                    }
+                    ptr = rotate_left(ptr);
+                }
+            }
+            ptr = ptr->parent;
+        }
+    }
+
+    void write_table(std::ostream &out) {
+        // Write every entry in alphabetical order as a numbered table. The
+        // caller holds the lock.
+        // Starting below every key walks the whole book, whether it's still
+        // an attached snapshot or a tree.
+        Cursor cursor(*this, "", true, Cursor::UNBOUNDED, "");
+        write_table(out, count,
+                    [&cursor](Person &p) { return cursor.next(p); });
+    }
+
+    static void write_table(std::ostream &out, size_t entries,
+                            const std::function<bool(Person &)> &next) {
+        // The table of every entry next() hands out. Rows are gathered into
+        // large blocks rather than written one at a time.
+        std::string block = "Phonebook contains " + std::to_string(entries) +
+                            " entries.\n\n#\tFirst" + COLUMN_TAB_WIDTH +
+                            "Last" + COLUMN_TAB_WIDTH + "Phone Number\n" +
+                            DIVIDER + "\n";
+        block.reserve(DISPLAY_BUFFER_SIZE + 1024);
+        Person entry;
+        size_t counter = 1;
+        while (next(entry)) {
+            block += std::to_string(counter++);
+            block += '\t';
+            entry.display_person(block);
+            if (block.size() >= DISPLAY_BUFFER_SIZE) {
+                out.write(block.data(), block.size());
+                block.clear();
+            }
+        }
+        block += DIVIDER;
+        block += '\n';
+        out.write(block.data(), block.size());
+    }
+
+    BST_Node *locate_node(BST_Node *ptr, Person *p, bool return_parent) {
+        // If the pointer runs off the tree we return nullptr. This means that
+        // the tree is either empty or the target isn't in the tree.
+        while (ptr) {
+            int direction = compare_names(*p, ptr->person);
+            if (direction == 0) {
+                return ptr;
+            }
+
+            // We can compare strings alphabetically so that's what's happening
+            // here.
+            BST_Node *child = direction == -1 ? ptr->left : ptr->right;
+            // If we're returning the parent of the node then we check if we
+            // need to return with this if statement.
+            if (return_parent && child &&
+                compare_names(child->person, *p) == 0) {
+                return ptr;
+            }
+            // Continue down the matching subtree.
+            ptr = child;
+        }
+        return nullptr;
+    }
+
+    void build_preorder_list(BST_Node *ptr, BST_Node **l, size_t &counter) {
+        // Perform preorder traversal. Root, left, right.
+        // The counter is passed by reference so the caller knows how many
+        // nodes were written.
+        BST_Cursor cursor(ptr, BST_Cursor::PREORDER);
+        while (BST_Node *node = cursor.next()) {
+            l[counter++] = node;
+        }
+    }
+
+    int compare_names(const Person &p1, const Person &p2) {
+        // Perform alphabetical comparisons on last and first names.
+        Metrics::count_comparison();
+        return Person::compare(p1, p2);
+    }
+
+    void first_last_to_upper(std::string &first, std::string &last) {
+        // Convert first and last name to upper case in place.
+        std::transform(first.begin(), first.end(), first.begin(), ::toupper);
+        std::transform(last.begin(), last.end(), last.begin(), ::toupper);
+    }
+
+    void index_phone(BST_Node *node) {
+        phone_index.emplace(normalize_phone(node->person.phone_number()), node);
+    }
+
+    void unindex_phone(BST_Node *node) {
+        // Remove this node's entry, leaving anyone else on the same number.
+        std::string key = normalize_phone(node->person.phone_number());
+        auto matches = phone_index.equal_range(key);
+        for (auto it = matches.first; it != matches.second; ++it) {
+            if (it->second == node) {
+                phone_index.erase(it);
+                return;
+            }
+        }
+    }
+
+    static std::string normalize_phone(const std::string &phone_number) {
+        // Keep only the digits. A number with none is matched as typed,
+        // ignoring case.
+        std::string digits;
+        for (size_t i = 0; i < phone_number.length(); i++) {
+            if (phone_number[i] >= '0' && phone_number[i] <= '9') {
+                digits.push_back(phone_number[i]);
+            }
+        }
+        if (digits.empty()) {
+            digits = phone_number;
+            std::transform(digits.begin(), digits.end(), digits.begin(),
+                           ::toupper);
+        }
+        return digits;
+    }
+
+    bool person_at(size_t rank, Person &result) {
+        // select() for a caller that already holds the lock. Each step down
+        // skips the whole left subtree if the rank lies beyond it.
+        if (rank == 0 || rank > size_t(count)) {
+            return false;
+        }
+        if (snapshot.is_open()) {
+            result = snapshot.person(rank - 1);
+            return true;
+        }
+        if (use_bplus_tree) {
+            result = bplus_tree.select(rank - 1)->person;
+            return true;
+        }
+        BST_Node *ptr = head;
+        while (ptr) {
+            size_t left = node_size(ptr->left);
+            if (rank <= left) {
+                ptr = ptr->left;
+            } else if (rank == left + 1) {
+                result = ptr->person;
+                return true;
+            } else {
+                rank -= left + 1;
+                ptr = ptr->right;
             }
         }
+        return false;
+    }
 
-        return true;
+    size_t count_below(const char *key, size_t length) {
+        // Number of entries whose raw key sorts before key. The caller holds
+        // the lock.
+        if (snapshot.is_open()) {
+            return snapshot.lower_bound(key, length, true);
+        }
+        if (use_bplus_tree) {
+            return bplus_tree.count_below(key, length);
+        }
+        size_t below = 0;
+        BST_Node *ptr = head;
+        while (ptr) {
+            Metrics::count_comparison();
+            if (ptr->person.compare_key(key, length) < 0) {
+                below += node_size(ptr->left) + 1;
+                ptr = ptr->right;
+            } else {
+                ptr = ptr->left;
+            }
+        }
+        return below;
+    }
+
+    BST_Node *locate_name(std::string first, std::string last) {
+        // The node for a name, or nullptr. The caller holds the lock.
+        first_last_to_upper(first, last);
+        std::string buffer;
+        Person p = Person::pack(first, last, "", buffer);
+        return find_node(p);
+    }
+
+    BST_Node *find_node(Person &p) {
+        // The node with p's name, from whichever tree the book keeps, or
+        // nullptr. The caller holds the lock.
+        if (use_bplus_tree) {
+            return bplus_tree.find(p.key, p.key_length());
+        }
+        return locate_node(head, &p, false);
+    }
+
+    void sorted_nodes(std::vector<BST_Node *> &nodes) {
+        // Every node in name order. The caller holds the lock.
+        nodes.reserve(count);
+        if (use_bplus_tree) {
+            int slot;
+            const BPlus_Tree::Leaf *leaf =
+                bplus_tree.lower_bound("", 0, true, slot);
+            for (; leaf; leaf = leaf->next) {
+                nodes.insert(nodes.end(), leaf->entries,
+                             leaf->entries + leaf->size);
+            }
+            return;
+        }
+        BST_Cursor cursor(head, BST_Cursor::INORDER);
+        while (BST_Node *node = cursor.next()) {
+            nodes.push_back(node);
+        }
+    }
+
+    std::string make_key(std::string first, std::string last) {
+        // The raw key bytes for a name, as compared by Person::compare_key.
+        first_last_to_upper(first, last);
+        return last + '\0' + first;
+    }
+};
+
+class Sharded_Book {
+    // A phonebook split across several Books by last name. Each shard is
+    // owned by a worker thread that makes every change and lookup on it,
+    // taken in order from a queue of its own, so changes to different
+    // shards run on different cores without any lock between them. A
+    // change hands back a future and the caller can queue more before
+    // waiting on it. Shards are chosen by ranges of the last name's first
+    // letter, which keeps neighbouring names together, or by a hash of the
+    // last name, which spreads them evenly. Either way everyone with the
+    // same last name shares a shard. Scans merge the shards back into name
+    // order, and each shard saves and loads its own files at the same time
+    // as the others.
+  public:
+    enum Partition { BY_RANGE, BY_HASH };
+
+    class Cursor {
+        // Streams entries in alphabetical order across every shard, like
+        // Book::Cursor. Each shard hands over a batch at a time, read on
+        // its worker thread, and the smallest of the batches' heads comes
+        // next. Changes made while a cursor is open may or may not show up,
+        // but never break it.
+      public:
+        bool next(Person &result) {
+            // Copy out the next entry, or return false once past the end.
+            size_t smallest = sources.size();
+            for (size_t i = 0; i < sources.size(); i++) {
+                Source &source = sources[i];
+                if (source.position == source.batch.size() &&
+                    !source.exhausted) {
+                    refill(i);
+                }
+                if (source.position < source.batch.size() &&
+                    (smallest == sources.size() ||
+                     Person::compare(
+                         source.batch[source.position],
+                         sources[smallest].batch[sources[smallest].position]) <
+                         0)) {
+                    smallest = i;
+                }
+            }
+            if (smallest == sources.size()) {
+                return false;
+            }
+            result = sources[smallest].batch[sources[smallest].position++];
+            return true;
+        }
+
+      private:
+        friend class Sharded_Book;
+        enum Bound { UNBOUNDED, PREFIX, UP_TO };
+
+        struct Source {
+            std::vector<Person> batch;
+            size_t position;
+            // Set once the shard has nothing left in bounds.
+            bool exhausted;
+        };
+
+        Sharded_Book *book;
+        std::vector<Source> sources;
+        Bound bound;
+        // Raw key bytes of the prefix or the last key in range.
+        std::string bound_key;
+
+        Cursor(Sharded_Book *book, const std::string &from, bool inclusive,
+               Bound bound, const std::string &bound_key)
+            : book(book), sources(book->shards.size()), bound(bound),
+              bound_key(bound_key) {
+            // Every shard reads its first batch at once.
+            std::vector<std::future<std::vector<Person>>> batches;
+            for (size_t i = 0; i < sources.size(); i++) {
+                batches.push_back(fetch(i, from, inclusive));
+            }
+            for (size_t i = 0; i < sources.size(); i++) {
+                take(i, batches[i].get());
+            }
+        }
+
+        void refill(size_t i) {
+            // The shard's next batch, after the last entry it handed over.
+            const Person &last = sources[i].batch.back();
+            take(i, fetch(i, std::string(last.key, last.key_length()), false)
+                        .get());
+        }
+
+        void take(size_t i, std::vector<Person> batch) {
+            Source &source = sources[i];
+            source.exhausted = batch.size() < SHARD_SCAN_BATCH;
+            source.batch.swap(batch);
+            source.position = 0;
+        }
+
+        std::future<std::vector<Person>> fetch(size_t i,
+                                               const std::string &from,
+                                               bool inclusive) {
+            // Up to a batch of the shard's entries from the raw key from on,
+            // stopping early at the bound.
+            Bound bound = this->bound;
+            std::string bound_key = this->bound_key;
+            return book->submit(i, [=](Book &shard) {
+                size_t split = from.find('\0');
+                std::string last = from.substr(0, split);
+                std::string first =
+                    split == std::string::npos ? "" : from.substr(split + 1);
+                Book::Cursor cursor = inclusive
+                                          ? shard.lower_bound(first, last)
+                                          : shard.upper_bound(first, last);
+                std::vector<Person> batch;
+                Person p;
+                while (batch.size() < SHARD_SCAN_BATCH && cursor.next(p) &&
+                       within_bound(bound, bound_key, p)) {
+                    batch.push_back(p);
+                }
+                return batch;
+            });
+        }
+
+        static bool within_bound(Bound bound, const std::string &bound_key,
+                                 const Person &p) {
+            if (bound == PREFIX) {
+                return p.has_prefix(bound_key.data(), bound_key.length());
+            } else if (bound == UP_TO) {
+                return p.compare_key(bound_key.data(), bound_key.length()) <= 0;
+            }
+            return true;
+        }
+    };
+
+    Sharded_Book() : Sharded_Book(SHARD_COUNT, BY_HASH) {}
+    Sharded_Book(size_t count, Partition partition)
+        : Sharded_Book(count, partition, BPLUS_TREE_BOOK) {}
+    // Every shard keeps its entries in the same kind of tree, a B+-tree if
+    // bplus_tree says so and an AVL tree otherwise.
+    Sharded_Book(size_t count, Partition partition, bool bplus_tree)
+        : partition(partition) {
+        for (size_t i = 0; i < std::max<size_t>(count, 1); i++) {
+            shards.push_back(
+                std::unique_ptr<Shard>(new Shard(i, bplus_tree)));
+        }
+        // Started once every shard exists, as a worker only ever touches
+        // its own.
+        for (size_t i = 0; i < shards.size(); i++) {
+            Shard &shard = *shards[i];
+            shard.worker = std::thread([&shard]() { serve(shard); });
+        }
+    }
+
+    ~Sharded_Book() {
+        // Let every worker finish what's queued, then stop.
+        for (size_t i = 0; i < shards.size(); i++) {
+            std::lock_guard<std::mutex> guard(shards[i]->mutex);
+            shards[i]->stopping = true;
+            shards[i]->ready.notify_one();
+        }
+        for (size_t i = 0; i < shards.size(); i++) {
+            shards[i]->worker.join();
+        }
+    }
+
+    Sharded_Book(const Sharded_Book &) = delete;
+    Sharded_Book &operator=(const Sharded_Book &) = delete;
+
+    size_t shard_count() const { return shards.size(); }
+
+    std::future<bool> add(const std::string &first, const std::string &last,
+                          const std::string &phone_number) {
+        return submit(shard_of(last), [=](Book &shard) {
+            return shard.add_entry(first, last, phone_number);
+        });
+    }
+
+    std::future<bool> change(const std::string &first,
+                             const std::string &last,
+                             const std::string &phone_number) {
+        return submit(shard_of(last), [=](Book &shard) {
+            return shard.change_entry(first, last, phone_number) != nullptr;
+        });
+    }
+
+    std::future<bool> remove(const std::string &first,
+                             const std::string &last) {
+        return submit(shard_of(last), [=](Book &shard) {
+            return shard.delete_entry(first, last);
+        });
+    }
+
+    bool find_person(const std::string &first, const std::string &last,
+                     Person &result) {
+        // Like Book::find_person. The result's text stays valid until its
+        // shard is next cleared or loaded.
+        std::pair<bool, Person> found =
+            submit(shard_of(last), [=](Book &shard) {
+                Person p;
+                bool exists = shard.find_person(first, last, p);
+                return std::make_pair(exists, p);
+            }).get();
+        result = found.second;
+        return found.first;
+    }
+
+    size_t size() {
+        size_t total = 0;
+        std::vector<std::future<size_t>> counts = each(
+            [](Book &shard) { return size_t(shard.count); });
+        for (size_t i = 0; i < counts.size(); i++) {
+            total += counts[i].get();
+        }
+        return total;
+    }
+
+    void set_quiet(bool quiet) {
+        wait_all(each([quiet](Book &shard) {
+            shard.set_quiet(quiet);
+            return true;
+        }));
+    }
+
+    Cursor scan() {
+        // Every entry.
+        return Cursor(this, "", true, Cursor::UNBOUNDED, "");
+    }
+
+    Cursor lower_bound(const std::string &first, const std::string &last) {
+        // Every entry from first last onwards.
+        return Cursor(this, make_key(first, last), true, Cursor::UNBOUNDED,
+                      "");
+    }
+
+    Cursor upper_bound(const std::string &first, const std::string &last) {
+        // Every entry after first last.
+        return Cursor(this, make_key(first, last), false, Cursor::UNBOUNDED,
+                      "");
+    }
+
+    Cursor range(const std::string &from_first, const std::string &from_last,
+                 const std::string &to_first, const std::string &to_last) {
+        // Every entry between the two names, both ends included, as in
+        // Book::range.
+        std::string to = make_key(to_first, to_last);
+        if (to_first.empty()) {
+            to.back() = '\1';
+        }
+        return Cursor(this, make_key(from_first, from_last), true,
+                      Cursor::UP_TO, to);
+    }
+
+    Cursor prefix(std::string text) {
+        // Every entry whose last name starts with text, or given as
+        // "LAST,FIRST", as in Book::prefix.
+        std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+        size_t comma = text.find(',');
+        if (comma != std::string::npos) {
+            text[comma] = '\0';
+        }
+        return Cursor(this, text, true, Cursor::PREFIX, text);
+    }
+
+    void display_book() {
+        // The same table Book::display_book prints, merged from every shard.
+        size_t entries = size();
+        if (entries == 0) {
+            std::cout << "\nNo records\n" << std::endl;
+            return;
+        }
+        Cursor cursor = scan();
+        Book::write_table(std::cout, entries,
+                          [&cursor](Person &p) { return cursor.next(p); });
+        std::cout << std::endl;
+    }
+
+    bool open_journal() {
+        // Give every shard a journal of its own. Journaled changes are tied
+        // to the split as much as saved ones, so the manifest has to match,
+        // and is written if there isn't one yet.
+        if (!matches_manifest(true)) {
+            return false;
+        }
+        return wait_all(each([](Book &shard) { return shard.open_journal(); }));
     }
 
     bool save() {
-        // Nothing to save.
-        if (is_empty()) {
+        // Every shard saves its own files at once, followed by a manifest
+        // saying how the book was split. A shard with nothing in it drops
+        // its files instead, so an old save can't bring entries back.
+        bool saved = wait_all(each([](Book &shard) {
+            if (shard.is_empty()) {
+                std::remove(shard.save_file.c_str());
+                std::remove(shard.snapshot_file.c_str());
+                return true;
+            }
+            return shard.save();
+        }));
+        return saved && write_manifest();
+    }
+
+    bool load() {
+        // Every shard loads its own files at once. Shards saved under a
+        // different split would leave names in the wrong shard, so the
+        // manifest has to match.
+        if (!matches_manifest(false)) {
             return false;
         }
+        std::vector<std::future<bool>> loads = each([](Book &shard) {
+            struct stat info;
+            if (stat(shard.save_file.c_str(), &info) != 0 &&
+                stat(shard.snapshot_file.c_str(), &info) != 0 &&
+                stat(shard.journal_file.c_str(), &info) != 0) {
+                // Saved while empty.
+                return true;
+            }
+            return shard.load();
+        });
+        bool loaded = false;
+        for (size_t i = 0; i < loads.size(); i++) {
+            loaded = loads[i].get() || loaded;
+        }
+        return loaded;
+    }
 
-        // Create a list to store the nodes as we do a preorder traversal.
-        BST_Node **preorder_list = new BST_Node *[count];
-        size_t counter = 0;
-        build_preorder_list(head, preorder_list, counter);
+  private:
+    struct Shard {
+        Book book;
+        std::mutex mutex;
+        std::condition_variable ready;
+        // Guarded by mutex.
+        std::deque<std::function<void()>> queue;
+        bool stopping;
+        std::thread worker;
 
-        std::ofstream File(SAVE_FILE_NAME);
-        File.clear();
+        Shard(size_t index, bool bplus_tree)
+            : book(BALANCED_TREE, false, bplus_tree), stopping(false) {
+            book.set_file_names(SHARD_FILE_STEM + std::to_string(index));
+        }
 
-        // Encode a line for each node we visit.
-        for (size_t i = 0; i < count; i++) {
-            Person p = preorder_list[i]->person;
-            File << p.encode();
-            if (i < count - 1) {
-                File << "\n";
+        // Book's lock stripes ask for more alignment than new gives before
+        // C++17.
+        static void *operator new(size_t size) {
+            void *memory;
+            if (posix_memalign(&memory, alignof(Shard), size) != 0) {
+                throw std::bad_alloc();
             }
+            return memory;
         }
-        // Clean up the list we used.
-        delete[] preorder_list;
-        // Close the file.
+        static void operator delete(void *memory) { std::free(memory); }
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    Partition partition;
+
+    std::string manifest() const {
+        return std::to_string(shards.size()) + "," +
+               (partition == BY_HASH ? "hash" : "range");
+    }
+
+    bool write_manifest() const {
+        std::string temporary = std::string(SHARD_MANIFEST_NAME) + ".tmp";
+        std::ofstream File(temporary, std::ios::trunc);
+        File << manifest() << "\n";
         File.close();
-        return true;
+        if (!File) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return replace_file(temporary, SHARD_MANIFEST_NAME);
     }
 
-    bool load() {
-        // Load a saved phonebook.
-        std::ifstream File(SAVE_FILE_NAME);
-        if (!File.good()) {
-            // Ensure the save file exists.
-            std::cout << "No save file located, please save a phonebook "
-                         "before loading."
-                      << std::endl;
-            File.close();
+    bool matches_manifest(bool create) const {
+        // Whether the files on disk were split the way this book splits
+        // names. A missing manifest is written if create is set.
+        std::ifstream File(SHARD_MANIFEST_NAME);
+        std::string saved;
+        if (!std::getline(File, saved)) {
+            if (create) {
+                return write_manifest();
+            }
+            std::cout << "No sharded save located" << std::endl;
+            return false;
+        }
+        if (saved != manifest()) {
+            std::cout << SHARD_MANIFEST_NAME << " was saved as " << saved
+                      << " shards, not " << manifest() << std::endl;
             return false;
         }
+        return true;
+    }
 
-        std::string line;
+    static void serve(Shard &shard) {
+        // The worker's loop. Everything queued since it last looked is taken
+        // in one go and run in order.
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        while (true) {
+            shard.ready.wait(lock, [&shard]() {
+                return shard.stopping || !shard.queue.empty();
+            });
+            if (shard.queue.empty()) {
+                return;
+            }
+            std::deque<std::function<void()>> tasks;
+            tasks.swap(shard.queue);
+            lock.unlock();
+            for (size_t i = 0; i < tasks.size(); i++) {
+                tasks[i]();
+            }
+            lock.lock();
+        }
+    }
 
-        // Clear the phonebook if we're going to load a new one in.
-        clear();
-        while (getline(File, line)) {
-            // Decode the file line by line and build a new tree based
-            // on the nodes read.
-            if (line.length() == 0) {
-                continue;
+    template <typename Work>
+    auto submit(size_t index, Work work)
+        -> std::future<decltype(work(std::declval<Book &>()))> {
+        // Queue work for a shard's worker, which calls it with the shard's
+        // book. The future holds what it returns.
+        typedef decltype(work(std::declval<Book &>())) Result;
+        Shard &shard = *shards[index];
+        std::shared_ptr<std::packaged_task<Result()>> task =
+            std::make_shared<std::packaged_task<Result()>>(
+                [&shard, work]() { return work(shard.book); });
+        std::future<Result> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            shard.queue.push_back([task]() { (*task)(); });
+        }
+        shard.ready.notify_one();
+        return result;
+    }
+
+    template <typename Work>
+    auto each(Work work)
+        -> std::vector<std::future<decltype(work(std::declval<Book &>()))>> {
+        // Queue work on every shard at once.
+        std::vector<std::future<decltype(work(std::declval<Book &>()))>>
+            results;
+        for (size_t i = 0; i < shards.size(); i++) {
+            results.push_back(submit(i, work));
+        }
+        return results;
+    }
+
+    static bool wait_all(std::vector<std::future<bool>> results) {
+        // Whether every shard succeeded. All of them are waited for either
+        // way.
+        bool all = true;
+        for (size_t i = 0; i < results.size(); i++) {
+            all = results[i].get() && all;
+        }
+        return all;
+    }
+
+    size_t shard_of(std::string last) const {
+        // The shard holding everyone with this last name.
+        std::transform(last.begin(), last.end(), last.begin(), ::toupper);
+        if (partition == BY_RANGE) {
+            // Names that don't start with a letter go to the first or last
+            // shard, whichever side of the alphabet they sort on.
+            unsigned char letter = last.empty() ? 0 : last[0];
+            if (letter < 'A') {
+                return 0;
+            } else if (letter > 'Z') {
+                return shards.size() - 1;
             }
-            Person p = Person::decode(line);
-            add_entry(p.first, p.last, p.phone_number);
+            return (letter - 'A') * shards.size() / 26;
+        }
+        // FNV-1a, rather than std::hash, so saved shards still line up when
+        // built with another standard library.
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < last.length(); i++) {
+            hash = (hash ^ static_cast<unsigned char>(last[i])) *
+                   1099511628211ULL;
         }
+        return hash % shards.size();
+    }
 
-        File.close();
+    static std::string make_key(std::string first, std::string last) {
+        // The raw key bytes for a name, as Book::make_key makes them.
+        std::transform(first.begin(), first.end(), first.begin(), ::toupper);
+        std::transform(last.begin(), last.end(), last.begin(), ::toupper);
+        return last + '\0' + first;
+    }
+};
+
+class Command_Processor {
+    // Runs the line protocol used by batch mode. Each line is a command and
+    // its arguments separated by spaces:
+    //
+    //   ADD first last phone     DEL first last      CHG first last phone
+    //   FIND first last          PHONE number        PREFIX text [limit]
+    //   FUZZY text [limit]       SAVE                CLEAR
+    //   BEGIN                    COMMIT              ABORT
+    //
+    // Every command is answered with "OK n" followed by n entries in save
+    // file format, or with a single "ERR reason" line. Blank lines and lines
+    // starting with # get no answer. Between BEGIN and COMMIT, ADD, DEL and
+    // CHG are only collected, and COMMIT makes all of them or none.
+  public:
+    explicit Command_Processor(Book &book)
+        : book(&book), in_transaction(false) {}
+
+    size_t execute_all(const char *data, size_t length, std::string &out) {
+        // Run every complete line in data, appending the answers to out.
+        // Returns how much of data was used up; an unfinished last line is
+        // left for the next call.
+        size_t used = 0;
+        while (used < length) {
+            const char *end = static_cast<const char *>(
+                std::memchr(data + used, '\n', length - used));
+            if (!end) {
+                break;
+            }
+            execute(data + used, end - (data + used), out);
+            used = end - data + 1;
+        }
+        return used;
+    }
+
+    void execute(const char *line, size_t length, std::string &out) {
+        // Run a single command, without its newline.
+        split(line, length);
+        if (words.empty() || words[0][0] == '#') {
+            return;
+        }
+        std::string &command = words[0];
+        std::transform(command.begin(), command.end(), command.begin(),
+                       ::toupper);
+        size_t limit = std::numeric_limits<size_t>::max();
+        if ((command == "PREFIX" || command == "FUZZY") &&
+            words.size() == 3) {
+            char *end;
+            limit = std::strtoul(words[2].c_str(), &end, 10);
+            if (*end != '\0') {
+                fail("limit must be a number", out);
+                return;
+            }
+        }
+
+        if (in_transaction && (command == "ADD" || command == "DEL" ||
+                               command == "CHG")) {
+            if (!queue_change(command)) {
+                fail("unknown command or wrong number of arguments", out);
+                return;
+            }
+            out += "OK 0\n";
+        } else if (command == "BEGIN" && words.size() == 1) {
+            if (in_transaction) {
+                fail("already in a transaction", out);
+                return;
+            }
+            in_transaction = true;
+            transaction.clear();
+            out += "OK 0\n";
+        } else if ((command == "COMMIT" || command == "ABORT") &&
+                   words.size() == 1) {
+            if (!in_transaction) {
+                fail("no transaction", out);
+                return;
+            }
+            in_transaction = false;
+            std::string error;
+            if (command == "ABORT" || book->apply(transaction, error)) {
+                out += "OK 0\n";
+            } else {
+                fail(error.c_str(), out);
+            }
+            transaction.clear();
+        } else if (command == "ADD" && words.size() == 4) {
+            succeed_if(book->add_entry(words[1], words[2], words[3]),
+                       "could not add entry", out);
+        } else if (command == "DEL" && words.size() == 3) {
+            succeed_if(book->delete_entry(words[1], words[2]),
+                       "entry not found", out);
+        } else if (command == "CHG" && words.size() == 4) {
+            succeed_if(book->change_entry(words[1], words[2], words[3]),
+                       "entry not found", out);
+        } else if (command == "FIND" && words.size() == 3) {
+            Person entry;
+            if (book->find_person(words[1], words[2], entry)) {
+                out += "OK 1\n";
+                append_entry(entry, out);
+            } else {
+                fail("entry not found", out);
+            }
+        } else if (command == "PHONE" && words.size() == 2) {
+            append_entries(book->find_by_phone(words[1]), out);
+        } else if (command == "PREFIX" &&
+                   (words.size() == 2 || words.size() == 3)) {
+            Book::Cursor cursor = book->prefix(words[1]);
+            std::vector<Person> entries;
+            Person entry;
+            while (entries.size() < limit && cursor.next(entry)) {
+                entries.push_back(entry);
+            }
+            append_entries(entries, out);
+        } else if (command == "FUZZY" &&
+                   (words.size() == 2 || words.size() == 3)) {
+            append_entries(book->fuzzy_search(words[1], words.size() == 3
+                                                            ? limit
+                                                            : FUZZY_RESULTS),
+                           out);
+        } else if (command == "SAVE" && words.size() == 1) {
+            succeed_if(book->save(), "nothing saved", out);
+        } else if (command == "CLEAR" && words.size() == 1) {
+            book->clear();
+            out += "OK 0\n";
+        } else {
+            fail("unknown command or wrong number of arguments", out);
+        }
+    }
+
+  private:
+    Book *book;
+    // The current line's words, kept between calls to reuse their storage.
+    std::vector<std::string> words;
+    // Changes collected since BEGIN.
+    bool in_transaction;
+    Book::Transaction transaction;
+
+    bool queue_change(const std::string &command) {
+        if (command == "ADD" && words.size() == 4) {
+            transaction.add(words[1], words[2], words[3]);
+        } else if (command == "DEL" && words.size() == 3) {
+            transaction.remove(words[1], words[2]);
+        } else if (command == "CHG" && words.size() == 4) {
+            transaction.change(words[1], words[2], words[3]);
+        } else {
+            return false;
+        }
         return true;
     }
 
-    void clear() {
-        // Clear out the BST.
-        clear_BST(head);
-        head = nullptr;
-        count = 0;
+    void split(const char *line, size_t length) {
+        words.clear();
+        size_t i = 0;
+        while (true) {
+            while (i < length && std::isspace(uint8_t(line[i]))) {
+                i++;
+            }
+            if (i == length) {
+                return;
+            }
+            size_t start = i;
+            while (i < length && !std::isspace(uint8_t(line[i]))) {
+                i++;
+            }
+            words.push_back(std::string(line + start, i - start));
+        }
+    }
+
+    static void succeed_if(bool success, const char *reason,
+                           std::string &out) {
+        if (success) {
+            out += "OK 0\n";
+        } else {
+            fail(reason, out);
+        }
+    }
+
+    static void fail(const char *reason, std::string &out) {
+        out += "ERR ";
+        out += reason;
+        out += '\n';
+    }
+
+    static void append_entry(const Person &entry, std::string &out) {
+        out += entry.encode();
+        out += '\n';
     }
 
-    bool is_empty() {
-        if (!head && count != 0) {
-            throw std::runtime_error("Error: Node count mismatch. Head doesn't "
-                                     "exist but the count isn't zero!");
+    static void append_entries(const std::vector<Person> &entries,
+                               std::string &out) {
+        out += "OK " + std::to_string(entries.size()) + "\n";
+        for (size_t i = 0; i < entries.size(); i++) {
+            append_entry(entries[i], out);
         }
-        return !head;
     }
+};
 
-  private:
-    BST_Node *head;
-    int count;
+// Set by SIGINT and SIGTERM to shut the server down cleanly.
+volatile sig_atomic_t server_stopping = 0;
 
-    BST_Node *insertion(BST_Node *ptr, BST_Node *new_node) {
-        // Check whether or not the new node is less than the pointer
-        if (compare_names(ptr->person, new_node->person) == 1) {
-            // If new_node belongs to the left of the pointer but the left child
-            // is nullptr then we can assign it to be the new_node.
-            if (!ptr->left) {
-                ptr->left = new_node;
-                count++;
-                return new_node;
-            }
-
-            // Otherwise, we can recurse down to the left.
-            return insertion(ptr->left, new_node);
-        } else if (compare_names(new_node->person, ptr->person) == 1) {
-            // Same process as above just for the right side.
-            if (!ptr->right) {
-                ptr->right = new_node;
-                count++;
-                return new_node;
-            }
-            return insertion(ptr->right, new_node);
-        } else {
-            std::cout << "\nName already exists in phonebook\n" << std::endl;
-        }
+void stop_server(int) { server_stopping = 1; }
 
-        return nullptr;
-    }
+class Server {
+    // Serves the batch mode protocol over a Unix domain socket to any number
+    // of clients, from one thread driven by epoll. Clients can pipeline,
+    // sending more commands without waiting for earlier answers, and get
+    // answers in order. Each pass of the event loop runs every complete
+    // command that arrived, journals the changes with a single sync shared by
+    // all the clients, and only then sends the answers. Like in batch mode,
+    // an answer means the change is on disk.
+  public:
+    explicit Server(Book &book)
+        : book(&book), listen_fd(-1), epoll_fd(-1) {}
 
-    void inorder_display(BST_Node *ptr, size_t &counter) {
-        // Recursive base case
-        if (!ptr) {
-            return;
+    ~Server() {
+        for (auto it = clients.begin(); it != clients.end(); ++it) {
+            ::close(it->first);
+            delete it->second;
+        }
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+            unlink(path.c_str());
+        }
+        if (epoll_fd >= 0) {
+            ::close(epoll_fd);
         }
-        // Recurse down left subtree
-        inorder_display(ptr->left, counter);
-        // /Once down the left sub-tree as the function calls get popped off the
-        // stack they return here in their execution and will print the
-        // information.
-        std::cout << counter++ << "\t";
-        ptr->person.display_person();
-        inorder_display(ptr->right, counter);
-        // Go down the right side of the tree.
     }
 
-    BST_Node *locate_node(BST_Node *ptr, Person *p, bool return_parent) {
-        if (!ptr) {
-            // If the pointer is nullptr, return nullptr.
-            // This means that the tree is either empty
-            // or the target isn't in the tree.
-            return nullptr;
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    bool listen(const char *path) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (std::strlen(path) >= sizeof(address.sun_path)) {
+            std::cout << "Socket path is too long: " << path << std::endl;
+            return false;
+        }
+        std::strcpy(address.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+        // A socket file nobody answers on was left by a server that didn't
+        // shut down cleanly, and can go.
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) == 0) {
+            std::cout << "A server is already listening on " << path
+                      << std::endl;
+            ::close(fd);
+            return false;
+        }
+        unlink(path);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address),
+                 sizeof(address)) != 0 ||
+            ::listen(fd, SOMAXCONN) != 0) {
+            std::cout << "Could not listen on " << path << std::endl;
+            ::close(fd);
+            return false;
         }
+        listen_fd = fd;
+        this->path = path;
 
-        if (compare_names(ptr->person, *p) == 0) {
-            return ptr;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            return false;
         }
-        // We can compare strings alphabetically so that's what's happening
-        // here.
-        else if (compare_names(*p, ptr->person) == -1) {
-            // If we're returning the parent of the node then we check if we
-            // need to return with this if statement.
-            if (return_parent && ptr->left &&
-                compare_names(ptr->left->person, *p) == 0) {
-                return ptr;
+        // The listening socket is the one event without a client.
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == 0;
+    }
+
+    void run() {
+        // Serve until stop_server() is called.
+        std::vector<epoll_event> events(SERVER_MAX_EVENTS);
+        std::vector<Client *> answered;
+        while (!server_stopping) {
+            int ready = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cout << "epoll_wait failed" << std::endl;
+                return;
             }
-            // Recurse down left subtree.
-            return locate_node(ptr->left, p, return_parent);
-        } else {
-            if (return_parent && ptr->right &&
-                compare_names(ptr->right->person, *p) == 0) {
-                return ptr;
+            for (int i = 0; i < ready; i++) {
+                Client *client = static_cast<Client *>(events[i].data.ptr);
+                if (!client) {
+                    accept_clients();
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    read_client(client);
+                }
+                if (!client->answered) {
+                    client->answered = true;
+                    answered.push_back(client);
+                }
+            }
+            // One sync covers every client's changes from this pass.
+            book->sync();
+            for (size_t i = 0; i < answered.size(); i++) {
+                answered[i]->answered = false;
+                write_client(answered[i]);
             }
-            // Recurse down right subtree.
-            return locate_node(ptr->right, p, return_parent);
+            answered.clear();
         }
     }
 
-    void build_preorder_list(BST_Node *ptr, BST_Node **l, size_t &counter) {
-        // Perform preorder traversal. Root, left, right.
-        if (ptr == nullptr) {
-            return;
-        }
+  private:
+    struct Client {
+        // Each client has its own processor so their transactions stay
+        // apart.
+        explicit Client(Book &book) : processor(book) {}
 
-        // The counter is passed by reference to be able to keep track
-        // of it despite the recursive calls. This would not work if
-        // it were passed by value.
-        l[counter++] = ptr;
-        build_preorder_list(ptr->left, l, counter);
-        build_preorder_list(ptr->right, l, counter);
-    }
+        Command_Processor processor;
+        int fd;
+        // An unfinished command waiting for the rest of its line.
+        std::string input;
+        // Answers not yet sent, from sent onwards.
+        std::string output;
+        size_t sent;
+        // The client has stopped sending, or the connection broke.
+        bool finished;
+        bool broken;
+        // Already queued for write_client() this pass.
+        bool answered;
+        uint32_t events;
+    };
 
-    void clear_BST(BST_Node *ptr) {
-        // Perform post order traversal to clear the tree.
-        if (ptr == nullptr) {
-            return;
+    Book *book;
+    int listen_fd;
+    int epoll_fd;
+    std::string path;
+    std::unordered_map<int, Client *> clients;
+
+    void accept_clients() {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                // EAGAIN once the backlog is empty. Anything else is a client
+                // that gave up before being accepted.
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+            Client *client = new Client(*book);
+            client->fd = fd;
+            client->sent = 0;
+            client->finished = false;
+            client->broken = false;
+            client->answered = false;
+            client->events = EPOLLIN;
+            epoll_event event;
+            event.events = client->events;
+            event.data.ptr = client;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                ::close(fd);
+                delete client;
+                continue;
+            }
+            clients[fd] = client;
         }
+    }
 
-        clear_BST(ptr->left);
-        clear_BST(ptr->right);
-        delete ptr;
+    void read_client(Client *client) {
+        // Run every command the client has sent, until it runs out or has
+        // too many answers waiting.
+        char chunk[1 << 16];
+        while (!client->finished &&
+               client->output.size() - client->sent < SERVER_MAX_BACKLOG) {
+            ssize_t result = ::read(client->fd, chunk, sizeof(chunk));
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    client->finished = client->broken = true;
+                }
+                return;
+            }
+            if (result == 0) {
+                client->finished = true;
+                return;
+            }
+            client->input.append(chunk, result);
+            size_t used = client->processor.execute_all(
+                client->input.data(), client->input.size(), client->output);
+            client->input.erase(0, used);
+            if (client->input.size() > SERVER_MAX_BACKLOG) {
+                // Nobody sends a command that long on purpose.
+                client->finished = client->broken = true;
+                return;
+            }
+        }
     }
 
-    int compare_names(Person &p1, Person &p2) {
-        // Perform alphabetical comparisons on last and first names.
-        if (p1.last > p2.last) {
-            return 1;
-        } else if (p2.last > p1.last) {
-            return -1;
-        } else {
-            if (p1.first > p2.first) {
-                return 1;
-            } else if (p2.first > p1.first) {
-                return -1;
-            } else {
-                return 0;
+    void write_client(Client *client) {
+        // Send what the client can take, then wait for it to take more (or
+        // send more) as appropriate. Done clients are closed once every
+        // answer is out.
+        while (!client->broken && client->sent < client->output.size()) {
+            ssize_t result =
+                send(client->fd, client->output.data() + client->sent,
+                     client->output.size() - client->sent, MSG_NOSIGNAL);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    client->broken = true;
+                }
+                break;
             }
+            client->sent += result;
+        }
+        if (client->sent == client->output.size()) {
+            client->output.clear();
+            client->sent = 0;
+        }
+        size_t backlog = client->output.size() - client->sent;
+        if (client->broken || (client->finished && backlog == 0)) {
+            close_client(client);
+            return;
+        }
+
+        uint32_t events = 0;
+        if (!client->finished && backlog < SERVER_MAX_BACKLOG) {
+            events |= EPOLLIN;
+        }
+        if (backlog > 0) {
+            events |= EPOLLOUT;
+        }
+        if (events != client->events) {
+            epoll_event event;
+            event.events = events;
+            event.data.ptr = client;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+            client->events = events;
         }
     }
 
-    void first_last_to_upper(std::string &first, std::string &last) {
-        // Convert first and last name to upper case in place.
-        std::transform(first.begin(), first.end(), first.begin(), ::toupper);
-        std::transform(last.begin(), last.end(), last.begin(), ::toupper);
+    void close_client(Client *client) {
+        // Closing the descriptor takes it out of epoll too.
+        clients.erase(client->fd);
+        ::close(client->fd);
+        delete client;
     }
 };
 
@@ -498,9 +6529,13 @@ class UserInterface {
     UserInterface(Book &phonebook)
         : phonebook(&phonebook), load_on_startup(LOAD_ON_STARTUP) {
         std::cout << "Initializing program..." << std::endl;
+        if (USE_JOURNAL && !phonebook.open_journal()) {
+            std::cout << "Could not open " << JOURNAL_FILE_NAME
+                      << ", changes will only be kept when saved" << std::endl;
+        }
         if (load_on_startup) {
             std::cout << "Looking for save file" << std::endl;
-            if (phonebook.load()) {
+            if (LAZY_LOAD ? phonebook.load_lazily() : phonebook.load()) {
                 std::cout << "Found " << SAVE_FILE_NAME << std::endl;
             }
         }
@@ -532,15 +6567,14 @@ class UserInterface {
                 }
                 std::string first_name = get_string_input("First name: ", true);
                 std::string last_name = get_string_input("Last name: ", true);
-                BST_Node *entry = phonebook->find_entry(first_name, last_name);
-
-                if (entry) {
+                Person entry;
+                if (phonebook->find_person(first_name, last_name, entry)) {
                     std::cout << "\nRecord found:\n\n";
                     std::cout << "First" << COLUMN_TAB_WIDTH << "Last"
                               << COLUMN_TAB_WIDTH << "Phone Number"
                               << std::endl;
                     std::cout << DIVIDER << std::endl;
-                    entry->person.display_person();
+                    entry.display_person();
                     std::cout << "\n" << std::endl;
                 } else {
                     std::cout << "\nEntry not found\n" << std::endl;
@@ -634,110 +6668,370 @@ class UserInterface {
                     if (p) {
                         std::cout << "\nSuccess\n" << std::endl;
                     }
-                } else {
-                    std::cout << "\nCancelled\n" << std::endl;
+                } else {
+                    std::cout << "\nCancelled\n" << std::endl;
+                }
+
+                wait_for_key();
+                break;
+            }
+            case 5: {
+                std::cout << "\n";
+                phonebook->display_book();
+                wait_for_key();
+                break;
+            }
+            case 6: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Clearing phonebook" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                bool confirmation =
+                    get_confirmation("Are you sure you wish to delete the "
+                                     "entire phonebook? (y/n)\n: ");
+                if (confirmation) {
+                    phonebook->clear();
+                    std::cout << "\nSuccessfully cleared phonebook\n"
+                              << std::endl;
+                    wait_for_key();
+                } else {
+                    std::cout << "\nCancelled\n" << std::endl;
+                }
+                break;
+            }
+            case 7: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Save Phonebook" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                bool confirmation =
+                    get_confirmation("Saving will overwrite previous save, "
+                                     "continue? (y/n)\n: ");
+                if (!confirmation) {
+                    std::cout << "\nCancelled\n" << std::endl;
+                    break;
+                }
+                if (phonebook->save()) {
+                    std::cout << "\nSuccessfully saved as " << SAVE_FILE_NAME
+                              << "\n"
+                              << std::endl;
+                } else {
+                    std::cout << "\nSave failed. Possible I/O error.\n"
+                              << std::endl;
+                }
+
+                wait_for_key();
+                break;
+            }
+            case 8: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Loading phonebook" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                bool confirmation = true;
+                if (!phonebook->is_empty()) {
+                    confirmation = get_confirmation(
+                        "Are you sure you wish to load a new phonebook? It "
+                        "will "
+                        "clear your current entires. (y/n)\n: ");
+                }
+                if (confirmation) {
+                    std::cout << "\n";
+                    phonebook->load();
+                    phonebook->display_book();
+                    std::cout << "\nSuccessfully loaded phonebook\n"
+                              << std::endl;
+                    wait_for_key();
+                } else {
+                    std::cout << "\nCancelled\n" << std::endl;
+                }
+                break;
+            }
+            case 9: {
+                // With the journal on, every change is already on disk.
+                bool confirmation = get_confirmation(
+                    USE_JOURNAL ? "Are you sure you want to exit? (y/n)\n: "
+                                : "Are you sure you want to exit? You may "
+                                  "have unsaved changes. (y/n)\n: ");
+                if (!confirmation) {
+                    std::cout << "\nCancelled\n" << std::endl;
+                    break;
+                }
+                phonebook->sync();
+                std::cout << "\n";
+                phonebook->print_statistics(std::cout);
+                std::cout << "\nGoodbye\n" << std::endl;
+                return;
+            }
+
+            case 10: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Search by prefix" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                std::string text = get_string_input(
+                    "Start of the last name, or LAST,FIRST: ", true);
+                Book::Cursor cursor = phonebook->prefix(text);
+                Person entry;
+                size_t counter = 0;
+                while (cursor.next(entry)) {
+                    if (counter == 0) {
+                        std::cout << "\n#\t" << "First" << COLUMN_TAB_WIDTH
+                                  << "Last" << COLUMN_TAB_WIDTH
+                                  << "Phone Number" << std::endl;
+                        std::cout << DIVIDER << std::endl;
+                    }
+                    std::cout << ++counter << "\t";
+                    entry.display_person();
+                }
+                if (counter == 0) {
+                    std::cout << "\nNo matching entries\n" << std::endl;
+                } else {
+                    std::cout << DIVIDER << "\n" << std::endl;
+                }
+                wait_for_key();
+                break;
+            }
+
+            case 11: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Find by phone number" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                std::string phone_number = get_string_input("Phone number: ");
+                std::vector<Person> entries =
+                    phonebook->find_by_phone(phone_number);
+                if (entries.empty()) {
+                    std::cout << "\nEntry not found\n" << std::endl;
+                } else {
+                    std::cout << "\nRecords found:\n\n";
+                    std::cout << "First" << COLUMN_TAB_WIDTH << "Last"
+                              << COLUMN_TAB_WIDTH << "Phone Number"
+                              << std::endl;
+                    std::cout << DIVIDER << std::endl;
+                    for (size_t i = 0; i < entries.size(); i++) {
+                        entries[i].display_person();
+                    }
+                    std::cout << "\n" << std::endl;
+                }
+                wait_for_key();
+                break;
+            }
+
+            case 12: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Fuzzy search" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                std::string text =
+                    get_string_input("Last name, or LAST,FIRST: ", true);
+                std::vector<Person> entries =
+                    phonebook->fuzzy_search(text, FUZZY_RESULTS);
+                if (entries.empty()) {
+                    std::cout << "\nNo close matches\n" << std::endl;
+                } else {
+                    std::cout << "\nClosest matches:\n\n";
+                    std::cout << "First" << COLUMN_TAB_WIDTH << "Last"
+                              << COLUMN_TAB_WIDTH << "Phone Number"
+                              << std::endl;
+                    std::cout << DIVIDER << std::endl;
+                    for (size_t i = 0; i < entries.size(); i++) {
+                        entries[i].display_person();
+                    }
+                    std::cout << "\n" << std::endl;
+                }
+                wait_for_key();
+                break;
+            }
+
+            case 13: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Statistics" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                phonebook->print_statistics(std::cout);
+                std::cout << std::endl;
+                wait_for_key();
+                break;
+            }
+
+            case 14: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Browse by page" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                // The first page starts at the given name or position, so
+                // finding it costs one descent of the tree however far in it
+                // is.
+                std::string text =
+                    get_string_input("Start at LAST, LAST,FIRST or #position "
+                                     "(* for the start): ",
+                                     true);
+                size_t counter = 1;
+                if (text.length() > 1 && text[0] == '#' &&
+                    text.find_first_not_of("0123456789", 1) ==
+                        std::string::npos &&
+                    text.length() < 20) {
+                    counter = std::max(std::stoull(text.substr(1)), 1ULL);
+                    text = "";
+                }
+                std::string first, last;
+                if (!text.empty() && text != "*") {
+                    size_t comma = text.find(',');
+                    last = text.substr(0, comma);
+                    if (comma != std::string::npos) {
+                        first = text.substr(comma + 1);
+                    }
+                    counter = phonebook->rank(first, last);
+                }
+                Book::Cursor cursor = text.empty()
+                                          ? phonebook->from_rank(counter)
+                                          : phonebook->lower_bound(first, last);
+                while (true) {
+                    std::cout << "\n#\t" << "First" << COLUMN_TAB_WIDTH
+                              << "Last" << COLUMN_TAB_WIDTH << "Phone Number"
+                              << "\n"
+                              << DIVIDER << "\n";
+                    size_t printed =
+                        Book::display_page(cursor, DISPLAY_PAGE_SIZE, counter);
+                    counter += printed;
+                    if (printed == 0) {
+                        std::cout << "No more entries\n";
+                    }
+                    std::cout << DIVIDER << std::endl;
+                    if (printed < DISPLAY_PAGE_SIZE ||
+                        get_string_input("n for the next page, anything else "
+                                         "to stop: ",
+                                         true) != "N") {
+                        break;
+                    }
                 }
-
                 wait_for_key();
                 break;
             }
-            case 5: {
-                std::cout << "\n";
-                phonebook->display_book();
+
+            case 16: {
+                std::cout << DIVIDER << std::endl;
+                std::cout << "Find by position" << std::endl;
+                std::cout << DIVIDER << std::endl;
+                if (phonebook->is_empty()) {
+                    std::cout << "\nPhonebook is empty\n" << std::endl;
+                    wait_for_key();
+                    break;
+                }
+                int position = get_int_input("Position (1 is the first "
+                                             "entry in alphabetical order): ");
+                Person entry;
+                if (position > 0 && phonebook->select(position, entry)) {
+                    std::cout << "\n#\t" << "First" << COLUMN_TAB_WIDTH
+                              << "Last" << COLUMN_TAB_WIDTH << "Phone Number"
+                              << "\n"
+                              << DIVIDER << "\n"
+                              << position << "\t";
+                    entry.display_person();
+                    std::cout << DIVIDER << "\n" << std::endl;
+                } else {
+                    std::cout << "\nNo entry at that position\n" << std::endl;
+                }
                 wait_for_key();
                 break;
             }
-            case 6: {
+
+            case 15: {
                 std::cout << DIVIDER << std::endl;
-                std::cout << "Clearing phonebook" << std::endl;
+                std::cout << "Export phonebook" << std::endl;
                 std::cout << DIVIDER << std::endl;
                 if (phonebook->is_empty()) {
                     std::cout << "\nPhonebook is empty\n" << std::endl;
                     wait_for_key();
                     break;
                 }
-                bool confirmation =
-                    get_confirmation("Are you sure you wish to delete the "
-                                     "entire phonebook? (y/n)\n: ");
-                if (confirmation) {
-                    phonebook->clear();
-                    std::cout << "\nSuccessfully cleared phonebook\n"
+                if (phonebook->export_book(EXPORT_FILE_NAME)) {
+                    std::cout << "\nExported to " << EXPORT_FILE_NAME << "\n"
                               << std::endl;
-                    wait_for_key();
                 } else {
-                    std::cout << "\nCancelled\n" << std::endl;
+                    std::cout << "\nExport failed. Possible I/O error.\n"
+                              << std::endl;
                 }
+                wait_for_key();
                 break;
             }
-            case 7: {
+
+            case 17: {
                 std::cout << DIVIDER << std::endl;
-                std::cout << "Save Phonebook" << std::endl;
+                std::cout << "Export compressed" << std::endl;
                 std::cout << DIVIDER << std::endl;
                 if (phonebook->is_empty()) {
                     std::cout << "\nPhonebook is empty\n" << std::endl;
                     wait_for_key();
                     break;
                 }
-                bool confirmation =
-                    get_confirmation("Saving will overwrite previous save, "
-                                     "continue? (y/n)\n: ");
-                if (!confirmation) {
-                    std::cout << "\nCancelled\n" << std::endl;
-                    break;
-                }
-                if (phonebook->save()) {
-                    std::cout << "\nSuccessfully saved as " << SAVE_FILE_NAME
-                              << "\n"
-                              << std::endl;
+                if (phonebook->export_compressed(COMPRESSED_FILE_NAME)) {
+                    std::cout << "\nExported to " << COMPRESSED_FILE_NAME
+                              << "\n" << std::endl;
                 } else {
-                    std::cout << "\nSave failed. Possible I/O error.\n"
+                    std::cout << "\nExport failed. Possible I/O error.\n"
                               << std::endl;
                 }
-
                 wait_for_key();
                 break;
             }
-            case 8: {
+
+            case 18: {
                 std::cout << DIVIDER << std::endl;
-                std::cout << "Loading phonebook" << std::endl;
+                std::cout << "Import compressed" << std::endl;
                 std::cout << DIVIDER << std::endl;
                 bool confirmation = true;
                 if (!phonebook->is_empty()) {
                     confirmation = get_confirmation(
-                        "Are you sure you wish to load a new phonebook? It "
-                        "will "
-                        "clear your current entires. (y/n)\n: ");
-                }
-                if (confirmation) {
-                    std::cout << "\n";
-                    phonebook->load();
-                    phonebook->display_book();
-                    std::cout << "\nSuccessfully loaded phonebook\n"
-                              << std::endl;
-                    wait_for_key();
-                } else {
-                    std::cout << "\nCancelled\n" << std::endl;
+                        "Are you sure you wish to import a phonebook? It will "
+                        "clear your current entries. (y/n)\n: ");
                 }
-                break;
-            }
-            case 9: {
-                bool confirmation =
-                    get_confirmation("Are you sure you want to exit? You may "
-                                     "have unsaved changes. (y/n)\n: ");
                 if (!confirmation) {
                     std::cout << "\nCancelled\n" << std::endl;
                     break;
                 }
-                std::cout << "\nGoodbye\n" << std::endl;
-                return;
+                std::cout << "\n";
+                if (phonebook->import_compressed(COMPRESSED_FILE_NAME)) {
+                    std::cout << "\nImported " << COMPRESSED_FILE_NAME << "\n"
+                              << std::endl;
+                } else {
+                    std::cout << "\nCould not import " << COMPRESSED_FILE_NAME
+                              << "\n" << std::endl;
+                }
+                wait_for_key();
+                break;
             }
 
             default:
-                std::cout << "\nPlease select a number between "
-                             "1 and 5\n"
+                std::cout << "\nPlease select an option from the menu\n"
                           << std::endl;
                 break;
             }
+            // Flush whatever the selected option changed to the journal.
+            phonebook->sync();
         }
     }
 
@@ -821,11 +7115,1012 @@ class UserInterface {
         std::cout << "6. Clear all entries" << std::endl;
         std::cout << "7. Save phonebook" << std::endl;
         std::cout << "8. Load phonebook" << std::endl;
+        std::cout << "10. Search by prefix" << std::endl;
+        std::cout << "11. Find by phone number" << std::endl;
+        std::cout << "12. Fuzzy search" << std::endl;
+        std::cout << "13. Statistics" << std::endl;
+        std::cout << "14. Browse by page" << std::endl;
+        std::cout << "15. Export phonebook" << std::endl;
+        std::cout << "16. Find by position" << std::endl;
+        std::cout << "17. Export compressed" << std::endl;
+        std::cout << "18. Import compressed" << std::endl;
         std::cout << "9. Quit\n" << std::endl;
     }
 };
 
-int main() {
-    Book b = Book();
+// Names used to make up synthetic phonebooks for the benchmarks.
+const char *const SYNTHETIC_FIRST_NAMES[] = {
+    "SYDNEY", "ALISON", "NORBERT", "RENEE",  "TESSA",   "GARTH",  "MARISOL",
+    "ERIKA",  "DAMIAN", "LENA",    "JOSUE",  "CARLTON", "ERMA",   "DUSTY",
+    "SHARI",  "GRAY",   "LOIS",    "JERRELL", "AL",     "JO",     "ARLENE",
+    "JAMES",  "BARRETT", "ALINE",  "JAYNE",  "DEIDRE",  "ADAN"};
+const char *const SYNTHETIC_LAST_NAMES[] = {
+    "MURRAY", "EATON",  "BENDER",  "AYERS",  "BALDWIN", "BARBER", "BRYAN",
+    "BOLTON", "CONRAD", "LOPEZ",   "FRENCH", "ESTRADA", "KLEIN",  "HARDY",
+    "HANSON", "JOHNSON", "LITT",   "MASON",  "MARQUEZ", "MCLEAN", "MORTON",
+    "MIRE",   "PENA",   "NEWMAN",  "ZHANG",  "RICE",    "SUAREZ"};
+constexpr size_t SYNTHETIC_NAME_COUNT = 27;
+
+void synthetic_entry(size_t i, std::string &first, std::string &last,
+                     std::string &phone_number) {
+    // The i-th made up entry. Every i gives a different name: once the
+    // first and last name pairs run out, letters are tacked onto the last
+    // name.
+    first = SYNTHETIC_FIRST_NAMES[i % SYNTHETIC_NAME_COUNT];
+    last = SYNTHETIC_LAST_NAMES[(i / SYNTHETIC_NAME_COUNT) %
+                                SYNTHETIC_NAME_COUNT];
+    for (size_t n = i / (SYNTHETIC_NAME_COUNT * SYNTHETIC_NAME_COUNT); n;
+         n /= 26) {
+        last.push_back(char('A' + n % 26));
+    }
+    uint64_t digits = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    phone_number.clear();
+    for (int d = 0; d < 10; d++) {
+        phone_number.push_back(char('0' + (digits >> (6 * d)) % 10));
+    }
+}
+
+int bench_concurrent(size_t entries) {
+    // Measure how lookups on a thread-safe book scale with the number of
+    // threads, with and without a thread making changes at the same time.
+    Book book(true, true);
+    std::string first, last, phone_number;
+    for (size_t i = 0; i < entries; i++) {
+        synthetic_entry(i, first, last, phone_number);
+        book.add_entry(first, last, phone_number);
+    }
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> thread_counts;
+    for (unsigned threads = 1; threads < cores; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(cores);
+
+    std::cout << "Book of " << entries << " entries, " << cores << " cores"
+              << std::endl;
+    std::cout << "Readers\tWriter\tLookups/sec\tWrites/sec\tSpeedup"
+              << std::endl;
+    for (int with_writer = 0; with_writer < 2; with_writer++) {
+        double single_thread_rate = 0;
+        for (size_t t = 0; t < thread_counts.size(); t++) {
+            std::atomic<bool> stop(false);
+            std::atomic<size_t> lookups(0), writes(0);
+            std::vector<std::thread> threads;
+            for (unsigned r = 0; r < thread_counts[t]; r++) {
+                threads.push_back(std::thread([&, r]() {
+                    std::string first, last, phone_number;
+                    Person found;
+                    size_t done = 0;
+                    uint64_t state = r * 7919 + 1;
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        state = state * 6364136223846793005ULL + 1;
+                        synthetic_entry((state >> 33) % entries, first, last,
+                                        phone_number);
+                        book.find_person(first, last, found);
+                        done++;
+                    }
+                    lookups += done;
+                }));
+            }
+            if (with_writer) {
+                threads.push_back(std::thread([&]() {
+                    std::string first, last, phone_number;
+                    size_t done = 0;
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        synthetic_entry(done % entries, first, last,
+                                        phone_number);
+                        book.change_entry(first, last, phone_number);
+                        done++;
+                    }
+                    writes += done;
+                }));
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            stop = true;
+            for (size_t i = 0; i < threads.size(); i++) {
+                threads[i].join();
+            }
+            if (t == 0) {
+                single_thread_rate = lookups;
+            }
+            std::cout << thread_counts[t] << "\t"
+                      << (with_writer ? "yes" : "no") << "\t" << lookups
+                      << "\t" << writes << "\t"
+                      << lookups / single_thread_rate << "x" << std::endl;
+        }
+    }
+    return 0;
+}
+
+int bench_parse(const char *path) {
+    // Time the original line-by-line decoder against CSV_Parser on the same
+    // file.
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        std::cout << "Could not open " << path << std::endl;
+        return 1;
+    }
+    double megabytes = info.st_size / (1024.0 * 1024.0);
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    size_t legacy_records = 0;
+    {
+        std::ifstream File(path);
+        std::string line, first, last, phone_number;
+        while (getline(File, line)) {
+            if (line.length() == 0) {
+                continue;
+            }
+            Person::decode(line, first, last, phone_number);
+            legacy_records++;
+        }
+    }
+    double legacy_seconds = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+
+    start = std::chrono::steady_clock::now();
+    size_t records = 0;
+    {
+        std::ifstream File(path);
+        CSV_Parser parser(File);
+        Field fields[3];
+        while (parser.next(fields)) {
+            records++;
+        }
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    std::cout << "Parsed " << megabytes << " MB" << std::endl;
+    std::cout << "Person::decode\t" << legacy_records << " records\t"
+              << legacy_seconds * 1000 << " ms\t" << megabytes / legacy_seconds
+              << " MB/s" << std::endl;
+    std::cout << "CSV_Parser\t" << records << " records\t" << seconds * 1000
+              << " ms\t" << megabytes / seconds << " MB/s" << std::endl;
+    std::cout << "Speedup\t" << legacy_seconds / seconds << "x" << std::endl;
+    return 0;
+}
+
+bool finish_batch(Book &book, std::string &out) {
+    // Make a batch's changes durable, then send its answers.
+    bool ok = book.sync() && write_all(STDOUT_FILENO, out.data(), out.size());
+    out.clear();
+    return ok;
+}
+
+int run_batch(const char *path) {
+    // Run commands from a file, or stdin without one, with no menus or
+    // confirmations. Whatever a single read returns is run as one batch: the
+    // batch's changes are journaled with one sync and then all of its
+    // answers go out in one write, so an answer means the change is on disk.
+    int fd = path ? ::open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0) {
+        std::cerr << "Could not open " << path << std::endl;
+        return 1;
+    }
+    // Stdout only carries answers, so the book's own messages go to stderr.
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    Book book;
+    book.set_quiet(true);
+    if (USE_JOURNAL) {
+        book.open_journal();
+    }
+    if (LOAD_ON_STARTUP) {
+        book.load();
+    }
+    Command_Processor processor(book);
+
+    std::vector<char> input(BATCH_READ_SIZE);
+    size_t filled = 0;
+    std::string out;
+    bool ok = true;
+    while (ok) {
+        if (filled == input.size()) {
+            // A single line longer than the buffer.
+            input.resize(input.size() * 2);
+        }
+        ssize_t result =
+            ::read(fd, input.data() + filled, input.size() - filled);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            // The last line may not have ended in a newline.
+            processor.execute(input.data(), filled, out);
+            ok = finish_batch(book, out);
+            break;
+        }
+        filled += result;
+        size_t used = processor.execute_all(input.data(), filled, out);
+        std::memmove(input.data(), input.data() + used, filled - used);
+        filled -= used;
+        ok = finish_batch(book, out);
+    }
+
+    std::cout.rdbuf(console);
+    if (path) {
+        ::close(fd);
+    }
+    return ok ? 0 : 1;
+}
+
+int run_server() {
+    // Load the book once and serve it until interrupted.
+    Book book;
+    book.set_quiet(true);
+    // Claim the socket first, so a second server gives up before loading.
+    // Clients that connect meanwhile wait for the load to finish.
+    Server server(book);
+    if (!server.listen(SERVER_SOCKET_NAME)) {
+        return 1;
+    }
+    if (USE_JOURNAL && !book.open_journal()) {
+        std::cout << "Could not open " << JOURNAL_FILE_NAME
+                  << ", changes will only be kept when saved" << std::endl;
+    }
+    if (LOAD_ON_STARTUP) {
+        book.load();
+    }
+
+    // Let a blocked epoll_wait() see the signal instead of restarting.
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Serving on " << SERVER_SOCKET_NAME
+              << ", press Ctrl-C to stop" << std::endl;
+    server.run();
+    book.sync();
+    std::cout << "\n";
+    book.print_statistics(std::cout);
+    std::cout << "\nGoodbye\n" << std::endl;
+    return 0;
+}
+
+int connect_to_server(const char *path) {
+    // A blocking connection to a running server, or -1.
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address),
+                           sizeof(address)) != 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int run_loadgen(size_t requests, size_t connections, size_t depth) {
+    // Hammer a running server with lookups of synthetic names from several
+    // connections at once, each keeping up to depth requests in flight, and
+    // report throughput and latency. Only lookups are sent, so it's safe to
+    // point at a real book.
+    constexpr size_t LOADGEN_NAMES = 1000000;
+    connections = std::max<size_t>(connections, 1);
+    depth = std::max<size_t>(depth, 1);
+    std::vector<std::vector<double>> latencies(connections);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (size_t c = 0; c < connections; c++) {
+        threads.push_back(std::thread([&, c]() {
+            size_t quota = requests / connections +
+                           (c < requests % connections ? 1 : 0);
+            int fd = connect_to_server(SERVER_SOCKET_NAME);
+            if (fd < 0) {
+                failed = true;
+                return;
+            }
+            std::vector<double> &measured = latencies[c];
+            measured.reserve(quota);
+            std::deque<std::chrono::steady_clock::time_point> in_flight;
+            std::string request, input, first, last, phone_number;
+            uint64_t state = c * 7919 + 1;
+            size_t sent = 0;
+            // Entries still to come in the answer being read, or -1 while
+            // waiting for its OK or ERR line.
+            long rows_left = -1;
+            char chunk[1 << 16];
+            while (measured.size() < quota) {
+                // Top the pipeline back up.
+                request.clear();
+                std::chrono::steady_clock::time_point now =
+                    std::chrono::steady_clock::now();
+                while (sent < quota && in_flight.size() < depth) {
+                    state = state * 6364136223846793005ULL + 1;
+                    synthetic_entry((state >> 33) % LOADGEN_NAMES, first, last,
+                                    phone_number);
+                    request += "FIND " + first + " " + last + "\n";
+                    in_flight.push_back(now);
+                    sent++;
+                }
+                if (!write_all(fd, request.data(), request.size())) {
+                    failed = true;
+                    break;
+                }
+
+                ssize_t result = ::read(fd, chunk, sizeof(chunk));
+                if (result <= 0) {
+                    failed = true;
+                    break;
+                }
+                input.append(chunk, result);
+                now = std::chrono::steady_clock::now();
+                size_t line_start = 0, newline;
+                while ((newline = input.find('\n', line_start)) !=
+                       std::string::npos) {
+                    if (rows_left < 0) {
+                        rows_left = input.compare(line_start, 3, "OK ") == 0
+                                        ? std::strtol(&input[line_start + 3],
+                                                      nullptr, 10)
+                                        : 0;
+                    } else {
+                        rows_left--;
+                    }
+                    if (rows_left == 0) {
+                        measured.push_back(
+                            std::chrono::duration<double, std::micro>(
+                                now - in_flight.front())
+                                .count());
+                        in_flight.pop_front();
+                        rows_left = -1;
+                    }
+                    line_start = newline + 1;
+                }
+                input.erase(0, line_start);
+            }
+            ::close(fd);
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (failed) {
+        std::cout << "Lost the connection to a server on "
+                  << SERVER_SOCKET_NAME << " (is one running?)" << std::endl;
+        return 1;
+    }
+
+    std::vector<double> all;
+    for (size_t c = 0; c < connections; c++) {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        return all.empty() ? 0.0 : all[size_t(p * (all.size() - 1))];
+    };
+    std::cout << requests << " requests over " << connections
+              << " connections, " << depth << " in flight each" << std::endl;
+    std::cout << "Requests/sec\tp50 us\tp99 us\tp99.9 us\tmax us" << std::endl;
+    std::cout << static_cast<long long>(all.size() / seconds) << "\t"
+              << percentile(0.5) << "\t" << percentile(0.99) << "\t"
+              << percentile(0.999) << "\t" << percentile(1.0) << std::endl;
+    return 0;
+}
+
+class Bench_Timer {
+    // Times each call of a benchmarked operation. The total only counts the
+    // calls themselves, not making up their arguments, and a sample of the
+    // calls is kept for latency percentiles.
+  public:
+    explicit Bench_Timer(size_t calls)
+        : stride(std::max<size_t>(1, calls / BENCH_LATENCY_SAMPLES)), calls(0),
+          total(0) {}
+
+    template <typename Operation> void time(Operation operation) {
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        operation();
+        uint64_t nanoseconds =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        total += nanoseconds;
+        if (calls++ % stride == 0) {
+            samples.push_back(nanoseconds);
+        }
+    }
+
+    size_t count() const { return calls; }
+    double seconds() const { return total / 1e9; }
+
+    uint64_t percentile(double p) {
+        // p between 0 and 1, over the sampled calls.
+        if (samples.empty()) {
+            return 0;
+        }
+        size_t rank = size_t(p * (samples.size() - 1));
+        std::nth_element(samples.begin(), samples.begin() + rank,
+                         samples.end());
+        return samples[rank];
+    }
+
+  private:
+    size_t stride;
+    size_t calls;
+    uint64_t total;
+    std::vector<uint64_t> samples;
+};
+
+std::vector<uint32_t> synthetic_sorted_order(size_t entries) {
+    // The indices of the first entries synthetic entries in name order. Entry
+    // i pairs the (i / 27)-th last name with the (i % 27)-th first name, so
+    // only the distinct last names need sorting.
+    size_t last_names =
+        (entries + SYNTHETIC_NAME_COUNT - 1) / SYNTHETIC_NAME_COUNT;
+    std::vector<std::pair<std::string, uint32_t>> lasts(last_names);
+    std::string first, last, phone_number;
+    for (size_t l = 0; l < last_names; l++) {
+        synthetic_entry(l * SYNTHETIC_NAME_COUNT, first, last, phone_number);
+        lasts[l] = std::make_pair(last, uint32_t(l));
+    }
+    std::sort(lasts.begin(), lasts.end());
+    std::vector<uint32_t> firsts(SYNTHETIC_NAME_COUNT);
+    for (size_t f = 0; f < SYNTHETIC_NAME_COUNT; f++) {
+        firsts[f] = f;
+    }
+    std::sort(firsts.begin(), firsts.end(), [](uint32_t a, uint32_t b) {
+        return std::strcmp(SYNTHETIC_FIRST_NAMES[a], SYNTHETIC_FIRST_NAMES[b]) <
+               0;
+    });
+
+    std::vector<uint32_t> order;
+    order.reserve(entries);
+    for (size_t l = 0; l < last_names; l++) {
+        for (size_t f = 0; f < SYNTHETIC_NAME_COUNT; f++) {
+            size_t i = lasts[l].second * SYNTHETIC_NAME_COUNT + firsts[f];
+            if (i < entries) {
+                order.push_back(i);
+            }
+        }
+    }
+    return order;
+}
+
+void bench_report(std::ostream &out, const char *operation, const char *order,
+                  size_t entries, double seconds, Bench_Timer *timer,
+                  int height) {
+    // One JSON object per line. Bulk operations (save and load) have no
+    // per-call timer and count entries per second as their ops/sec.
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t operations = timer ? timer->count() : entries;
+    out << "{\"op\":\"" << operation << "\",\"order\":\"" << order
+        << "\",\"entries\":" << entries << ",\"seconds\":" << seconds
+        << ",\"ops_per_sec\":"
+        << static_cast<long long>(seconds > 0 ? operations / seconds : 0);
+    if (timer) {
+        out << ",\"p50_ns\":" << timer->percentile(0.5)
+            << ",\"p90_ns\":" << timer->percentile(0.9)
+            << ",\"p99_ns\":" << timer->percentile(0.99)
+            << ",\"p999_ns\":" << timer->percentile(0.999)
+            << ",\"max_ns\":" << timer->percentile(1.0);
+    }
+    out << ",\"height\":" << height << ",\"peak_rss_kb\":" << usage.ru_maxrss
+        << "}" << std::endl;
+}
+
+double bench_seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+int bench_suite(size_t max_entries) {
+    // Time add, find, save, load and delete on synthetic books of 10^3
+    // entries up to max_entries, added in random, sorted and reverse sorted
+    // order. Results are JSON lines on stdout so runs can be compared across
+    // versions; peak RSS is for the whole run so far. The save files go in a
+    // scratch directory, leaving the real ones alone.
+    char directory[] = "/tmp/phonebook-bench-XXXXXX";
+    char *previous = getcwd(nullptr, 0);
+    if (!previous || !mkdtemp(directory) || chdir(directory) != 0) {
+        std::cout << "Could not create a scratch directory" << std::endl;
+        std::free(previous);
+        return 1;
+    }
+    // Only results go to stdout; the book's own messages go to stderr.
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    std::ostream results(console);
+    const char *const orders[] = {"random", "sorted", "reverse"};
+    std::string first, last, phone_number;
+
+    for (size_t entries = 1000; entries <= max_entries; entries *= 10) {
+        std::vector<uint32_t> sorted = synthetic_sorted_order(entries);
+        std::vector<uint32_t> shuffled = sorted;
+        std::mt19937 random(entries);
+        std::shuffle(shuffled.begin(), shuffled.end(), random);
+
+        for (int o = 0; o < 3; o++) {
+            const char *order = orders[o];
+            {
+                Book book;
+                book.set_quiet(true);
+                Bench_Timer add(entries);
+                for (size_t k = 0; k < entries; k++) {
+                    size_t i = sorted[o == 2 ? entries - 1 - k : k];
+                    if (o == 0) {
+                        i = shuffled[k];
+                    }
+                    synthetic_entry(i, first, last, phone_number);
+                    add.time([&]() {
+                        book.add_entry(first, last, phone_number);
+                    });
+                }
+                bench_report(results, "add", order, entries, add.seconds(),
+                             &add, book.height());
+
+                Bench_Timer find(entries);
+                Person found;
+                for (size_t k = 0; k < entries; k++) {
+                    synthetic_entry(shuffled[k], first, last, phone_number);
+                    find.time(
+                        [&]() { book.find_person(first, last, found); });
+                }
+                bench_report(results, "find", order, entries, find.seconds(),
+                             &find, book.height());
+
+                std::chrono::steady_clock::time_point start =
+                    std::chrono::steady_clock::now();
+                book.save();
+                bench_report(results, "save", order, entries,
+                             bench_seconds_since(start), nullptr,
+                             book.height());
+            }
+            if (USE_SNAPSHOT) {
+                // Mapping the snapshot and building the tree from it.
+                Book book;
+                book.set_quiet(true);
+                std::chrono::steady_clock::time_point start =
+                    std::chrono::steady_clock::now();
+                book.load();
+                book.find_entry("", "");
+                bench_report(results, "load_snapshot", order, entries,
+                             bench_seconds_since(start), nullptr,
+                             book.height());
+                std::remove(SNAPSHOT_FILE_NAME);
+            }
+            {
+                Book book;
+                book.set_quiet(true);
+                std::chrono::steady_clock::time_point start =
+                    std::chrono::steady_clock::now();
+                book.load();
+                bench_report(results, "load", order, entries,
+                             bench_seconds_since(start), nullptr,
+                             book.height());
+
+                Bench_Timer remove(entries);
+                for (size_t k = 0; k < entries; k++) {
+                    synthetic_entry(shuffled[k], first, last, phone_number);
+                    remove.time(
+                        [&]() { book.delete_entry(first, last); });
+                }
+                bench_report(results, "delete", order, entries,
+                             remove.seconds(), &remove, book.height());
+            }
+            std::remove(SAVE_FILE_NAME);
+        }
+    }
+
+    std::cout.rdbuf(console);
+    if (chdir(previous) == 0) {
+        rmdir(directory);
+    }
+    std::free(previous);
+    return 0;
+}
+
+int bench_engines(size_t entries) {
+    // Race the AVL tree against the B+-tree on the same synthetic book: adds
+    // in random order, lookups in another random order and whole in-order
+    // scans. The names are made up front, so only the book's work is timed.
+    // One JSON object per engine and operation on stdout, like --bench.
+    std::vector<std::string> firsts(entries), lasts(entries), phones(entries);
+    for (size_t i = 0; i < entries; i++) {
+        synthetic_entry(i, firsts[i], lasts[i], phones[i]);
+    }
+    std::vector<uint32_t> adds(entries);
+    for (size_t i = 0; i < entries; i++) {
+        adds[i] = i;
+    }
+    std::mt19937 random(entries);
+    std::shuffle(adds.begin(), adds.end(), random);
+    std::vector<uint32_t> finds = adds;
+    std::shuffle(finds.begin(), finds.end(), random);
+    const int scans = 5;
+
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    std::ostream results(console);
+    const char *const engines[] = {"avl", "bplus"};
+    for (int e = 0; e < 2; e++) {
+        Book book(true, false, e == 1);
+        book.set_quiet(true);
+        auto report = [&](const char *operation, size_t operations,
+                          double seconds) {
+            results << "{\"engine\":\"" << engines[e] << "\",\"op\":\""
+                    << operation << "\",\"entries\":" << entries
+                    << ",\"seconds\":" << seconds << ",\"ops_per_sec\":"
+                    << static_cast<long long>(
+                           seconds > 0 ? operations / seconds : 0)
+                    << ",\"height\":" << book.height() << "}" << std::endl;
+        };
+
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        for (size_t k = 0; k < entries; k++) {
+            size_t i = adds[k];
+            book.add_entry(firsts[i], lasts[i], phones[i]);
+        }
+        report("add", entries, bench_seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        size_t found = 0;
+        Person p;
+        for (size_t k = 0; k < entries; k++) {
+            size_t i = finds[k];
+            found += book.find_person(firsts[i], lasts[i], p);
+        }
+        report("find", found, bench_seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        size_t scanned = 0;
+        for (int s = 0; s < scans; s++) {
+            Book::Cursor cursor = book.lower_bound("", "");
+            while (cursor.next(p)) {
+                scanned++;
+            }
+        }
+        report("scan", scanned, bench_seconds_since(start));
+    }
+    std::cout.rdbuf(console);
+    return 0;
+}
+
+int bench_shards(size_t entries, size_t shard_count) {
+    // Race a sharded book against a single Book on the same synthetic
+    // entries: adds in random order, lookups, a whole in-order scan, then a
+    // save and a load. The sharded book keeps adds in flight and only waits
+    // on them in batches. One JSON object per book and operation on stdout,
+    // like --bench. The files go in a scratch directory.
+    char directory[] = "/tmp/phonebook-bench-XXXXXX";
+    char *previous = getcwd(nullptr, 0);
+    if (!previous || !mkdtemp(directory) || chdir(directory) != 0) {
+        std::cout << "Could not create a scratch directory" << std::endl;
+        std::free(previous);
+        return 1;
+    }
+    std::vector<std::string> firsts(entries), lasts(entries), phones(entries);
+    for (size_t i = 0; i < entries; i++) {
+        synthetic_entry(i, firsts[i], lasts[i], phones[i]);
+    }
+    std::vector<uint32_t> adds(entries);
+    for (size_t i = 0; i < entries; i++) {
+        adds[i] = i;
+    }
+    std::mt19937 random(entries);
+    std::shuffle(adds.begin(), adds.end(), random);
+    std::vector<uint32_t> finds = adds;
+    std::shuffle(finds.begin(), finds.end(), random);
+
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    std::ostream results(console);
+    auto report = [&](const char *book, const char *operation,
+                      double seconds) {
+        results << "{\"book\":\"" << book << "\",\"shards\":"
+                << (std::string(book) == "single" ? 1 : shard_count)
+                << ",\"op\":\"" << operation << "\",\"entries\":"
+                << entries << ",\"seconds\":" << seconds
+                << ",\"ops_per_sec\":"
+                << static_cast<long long>(seconds > 0 ? entries / seconds : 0)
+                << "}" << std::endl;
+    };
+    std::chrono::steady_clock::time_point start;
+    Person p;
+
+    {
+        Book book;
+        book.set_quiet(true);
+        start = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < entries; k++) {
+            size_t i = adds[k];
+            book.add_entry(firsts[i], lasts[i], phones[i]);
+        }
+        report("single", "add", bench_seconds_since(start));
+        start = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < entries; k++) {
+            size_t i = finds[k];
+            book.find_person(firsts[i], lasts[i], p);
+        }
+        report("single", "find", bench_seconds_since(start));
+        start = std::chrono::steady_clock::now();
+        Book::Cursor cursor = book.prefix("");
+        while (cursor.next(p)) {
+        }
+        report("single", "scan", bench_seconds_since(start));
+        start = std::chrono::steady_clock::now();
+        book.save();
+        report("single", "save", bench_seconds_since(start));
+    }
+    // Both books load by parsing their text saves, rather than mapping
+    // snapshots and building nothing until asked.
+    std::remove(SNAPSHOT_FILE_NAME);
+    {
+        Book book;
+        book.set_quiet(true);
+        start = std::chrono::steady_clock::now();
+        book.load();
+        report("single", "load", bench_seconds_since(start));
+    }
+
+    for (int hashed = 0; hashed < 2; hashed++) {
+        const char *name = hashed ? "hash" : "range";
+        Sharded_Book::Partition partition =
+            hashed ? Sharded_Book::BY_HASH : Sharded_Book::BY_RANGE;
+        {
+            Sharded_Book book(shard_count, partition);
+            book.set_quiet(true);
+            start = std::chrono::steady_clock::now();
+            std::vector<std::future<bool>> pending;
+            for (size_t k = 0; k < entries; k++) {
+                size_t i = adds[k];
+                pending.push_back(book.add(firsts[i], lasts[i], phones[i]));
+                if (pending.size() == 4096 || k + 1 == entries) {
+                    for (size_t j = 0; j < pending.size(); j++) {
+                        pending[j].get();
+                    }
+                    pending.clear();
+                }
+            }
+            report(name, "add", bench_seconds_since(start));
+            start = std::chrono::steady_clock::now();
+            for (size_t k = 0; k < entries; k++) {
+                size_t i = finds[k];
+                book.find_person(firsts[i], lasts[i], p);
+            }
+            report(name, "find", bench_seconds_since(start));
+            start = std::chrono::steady_clock::now();
+            Sharded_Book::Cursor cursor = book.scan();
+            while (cursor.next(p)) {
+            }
+            report(name, "scan", bench_seconds_since(start));
+            start = std::chrono::steady_clock::now();
+            book.save();
+            report(name, "save", bench_seconds_since(start));
+        }
+        for (size_t i = 0; i < shard_count; i++) {
+            std::string stem = SHARD_FILE_STEM + std::to_string(i);
+            std::remove((stem + ".snap").c_str());
+        }
+        {
+            Sharded_Book book(shard_count, partition);
+            book.set_quiet(true);
+            start = std::chrono::steady_clock::now();
+            book.load();
+            report(name, "load", bench_seconds_since(start));
+        }
+        for (size_t i = 0; i < shard_count; i++) {
+            std::string stem = SHARD_FILE_STEM + std::to_string(i);
+            std::remove((stem + ".txt").c_str());
+        }
+        std::remove(SHARD_MANIFEST_NAME);
+    }
+    std::remove(SAVE_FILE_NAME);
+
+    std::cout.rdbuf(console);
+    if (chdir(previous) == 0) {
+        rmdir(directory);
+    }
+    std::free(previous);
+    return 0;
+}
+
+int bench_compressed(size_t entries) {
+    // Save a synthetic book as text and export it compressed, then compare
+    // the two files' sizes, the time to load each back, and point lookups
+    // served from the compressed file without loading it. One JSON object
+    // per format and operation on stdout, like --bench. The files go in a
+    // scratch directory.
+    char directory[] = "/tmp/phonebook-bench-XXXXXX";
+    char *previous = getcwd(nullptr, 0);
+    if (!previous || !mkdtemp(directory) || chdir(directory) != 0) {
+        std::cout << "Could not create a scratch directory" << std::endl;
+        std::free(previous);
+        return 1;
+    }
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    std::ostream results(console);
+    auto report = [&](const char *format, const char *operation,
+                      size_t operations, double seconds, const char *path) {
+        struct stat info;
+        results << "{\"format\":\"" << format << "\",\"op\":\""
+                << operation << "\",\"entries\":" << entries
+                << ",\"bytes\":"
+                << (stat(path, &info) == 0 ? info.st_size : 0)
+                << ",\"seconds\":" << seconds << ",\"ops_per_sec\":"
+                << static_cast<long long>(
+                       seconds > 0 ? operations / seconds : 0)
+                << "}" << std::endl;
+    };
+    std::string first, last, phone_number;
+    std::chrono::steady_clock::time_point start;
+    {
+        Book book;
+        book.set_quiet(true);
+        for (size_t i = 0; i < entries; i++) {
+            synthetic_entry(i, first, last, phone_number);
+            book.add_entry(first, last, phone_number);
+        }
+        start = std::chrono::steady_clock::now();
+        book.save();
+        report("csv", "save", entries, bench_seconds_since(start),
+               SAVE_FILE_NAME);
+        start = std::chrono::steady_clock::now();
+        book.export_compressed(COMPRESSED_FILE_NAME);
+        report("compressed", "save", entries, bench_seconds_since(start),
+               COMPRESSED_FILE_NAME);
+    }
+    // The text file gets parsed rather than its snapshot mapped.
+    std::remove(SNAPSHOT_FILE_NAME);
+    {
+        Book book;
+        book.set_quiet(true);
+        start = std::chrono::steady_clock::now();
+        book.load();
+        report("csv", "load", entries, bench_seconds_since(start),
+               SAVE_FILE_NAME);
+    }
+    {
+        Book book;
+        book.set_quiet(true);
+        start = std::chrono::steady_clock::now();
+        book.import_compressed(COMPRESSED_FILE_NAME);
+        report("compressed", "load", entries, bench_seconds_since(start),
+               COMPRESSED_FILE_NAME);
+    }
+    {
+        std::mt19937 random(entries);
+        const size_t lookups = std::min<size_t>(entries, 100000);
+        start = std::chrono::steady_clock::now();
+        Compressed_File file;
+        file.open(COMPRESSED_FILE_NAME);
+        std::string key, buffer;
+        Person found;
+        for (size_t k = 0; k < lookups; k++) {
+            synthetic_entry(random() % entries, first, last, phone_number);
+            std::transform(first.begin(), first.end(), first.begin(),
+                           ::toupper);
+            std::transform(last.begin(), last.end(), last.begin(), ::toupper);
+            key = last + '\0' + first;
+            file.find(key.data(), key.length(), buffer, found);
+        }
+        report("compressed", "find", lookups, bench_seconds_since(start),
+               COMPRESSED_FILE_NAME);
+    }
+    std::remove(SAVE_FILE_NAME);
+    std::remove(COMPRESSED_FILE_NAME);
+
+    std::cout.rdbuf(console);
+    if (chdir(previous) == 0) {
+        rmdir(directory);
+    }
+    std::free(previous);
+    return 0;
+}
+
+int bench_startup(size_t entries) {
+    // Time from starting to load a synthetic book until its first lookup is
+    // answered, and until the whole tree is built, for load() and
+    // load_lazily(), starting from the save file alone and from a snapshot.
+    // One JSON object per case on stdout, like --bench. The files go in a
+    // scratch directory.
+    char directory[] = "/tmp/phonebook-bench-XXXXXX";
+    char *previous = getcwd(nullptr, 0);
+    if (!previous || !mkdtemp(directory) || chdir(directory) != 0) {
+        std::cout << "Could not create a scratch directory" << std::endl;
+        std::free(previous);
+        return 1;
+    }
+    std::streambuf *console = std::cout.rdbuf(std::cerr.rdbuf());
+    std::ostream results(console);
+    std::string first, last, phone_number;
+    {
+        Book book;
+        book.set_quiet(true);
+        for (size_t i = 0; i < entries; i++) {
+            synthetic_entry(i, first, last, phone_number);
+            book.add_entry(first, last, phone_number);
+        }
+        book.save();
+    }
+    synthetic_entry(entries / 2, first, last, phone_number);
+    for (int from_snapshot = 0; from_snapshot < 2; from_snapshot++) {
+        for (int lazy = 0; lazy < 2; lazy++) {
+            if (!from_snapshot) {
+                std::remove(SNAPSHOT_FILE_NAME);
+            }
+            Book book;
+            book.set_quiet(true);
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            if (lazy) {
+                book.load_lazily();
+            } else {
+                book.load();
+            }
+            Person found;
+            book.find_person(first, last, found);
+            double first_lookup = bench_seconds_since(start);
+            // Any change needs the whole tree.
+            book.find_entry(first, last);
+            double built = bench_seconds_since(start);
+            results << "{\"from\":\""
+                    << (from_snapshot ? "snapshot" : "save_file")
+                    << "\",\"load\":\"" << (lazy ? "lazy" : "full")
+                    << "\",\"entries\":" << entries
+                    << ",\"first_lookup_seconds\":" << first_lookup
+                    << ",\"built_seconds\":" << built << "}" << std::endl;
+        }
+    }
+    std::remove(SAVE_FILE_NAME);
+    std::remove(SNAPSHOT_FILE_NAME);
+
+    std::cout.rdbuf(console);
+    if (chdir(previous) == 0) {
+        rmdir(directory);
+    }
+    std::free(previous);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // Command line modes run instead of the interactive menu.
+    if (argc == 3 && std::string(argv[1]) == "--bench-parse") {
+        return bench_parse(argv[2]);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-concurrent") {
+        return bench_concurrent(argc >= 3 ? std::stoul(argv[2]) : 1000000);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--batch") {
+        return run_batch(argc >= 3 ? argv[2] : nullptr);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench") {
+        return bench_suite(argc >= 3 ? std::stoul(argv[2]) : 10000000);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-engines") {
+        return bench_engines(argc >= 3 ? std::stoul(argv[2]) : 1000000);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-shards") {
+        return bench_shards(argc >= 3 ? std::stoul(argv[2]) : 1000000,
+                            argc >= 4 ? std::stoul(argv[3]) : SHARD_COUNT);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-compressed") {
+        return bench_compressed(argc >= 3 ? std::stoul(argv[2]) : 1000000);
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--bench-startup") {
+        return bench_startup(argc >= 3 ? std::stoul(argv[2]) : 1000000);
+    }
+    if (argc == 2 && std::string(argv[1]) == "--serve") {
+        return run_server();
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--loadgen") {
+        return run_loadgen(argc >= 3 ? std::stoul(argv[2]) : 1000000,
+                           argc >= 4 ? std::stoul(argv[3]) : 4,
+                           argc >= 5 ? std::stoul(argv[4]) : 32);
+    }
+    Book b;
     UserInterface ui{b};
 }
\ No newline at end of file